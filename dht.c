@@ -7,16 +7,35 @@
  * DHT11/DHT22/AM2302/AM2320 driver for ESP8266 FreeRTOS SDK
  * Driver made by more strictly following standards than random sources
  *
- * Driver can use much less mem (define LOWMEM), if instead of measuring number
- * of cycles&storing them, we use Tlow with Thigh comparison, but it is more prone to errors
- * due measurement jitter, as algoritm execution time varies and tiny code are
- * in "time critical" part
+ * Driver can use much less mem (define LOWMEM), if instead of storing number
+ * of cycles, we decode each bit as it arrives. Durations are measured by CCOUNT
+ * from edge to edge, but tiny code is still in "time critical" part
+ *
+ * Bit threshold is calibrated on each frame by response preamble (Trel+Treh,
+ * nominally 160us) as sensor's own clock runs, so it doesn't depend on sensor
+ * timing spread or CPU frequency. dht_cal_get() reports threshold and how far
+ * shortest 1 and longest 0 were from it on last read.
+ *
+ * With IRQ_CAPTURE driver doesn't busy-wait at all: GPIO interrupt stores
+ * CCOUNT of each edge, and bits are decoded after frame received, so there is no
+ * long critical section. It takes over GPIO interrupt handler while reading,
+ * handler given to dht_irq_chain() still gets other pins meanwhile.
+ *
+ * dht_read_multi() reads several sensors, one per pin, at once: start signal is
+ * given on all pins together and one loop samples GPIO input register, so N
+ * sensors cost one critical section instead of N.
  */
 
+#ifdef HAL_LINUX
+#include "hal.h"
+#else
 #include "esp_common.h"
 #include <fcntl.h>
 #include <stdio.h>
 #include <gpio.h>
+#endif
+#include "esp8266stuff.h"
+#include "stats.h"
 /*
    Following list for PIN_FUNC_SELECT and PIN_PULLUP_DIS
    GPIO0:	PERIPHS_IO_MUX_GPIO0_U
@@ -49,31 +68,201 @@
 #define OW_OUT_HIGH() ( GPIO_OUTPUT_SET(GPIO_ID_PIN(OW_PIN_NUM), 1) )
 #define OW_DIR_IN()   ( GPIO_DIS_OUTPUT(GPIO_ID_PIN(OW_PIN_NUM)) )
 
-#define MAXWAIT 1000000 /* Max waiting cycles in waittransition, approx 1s */
+/*
+ * Max duration of each phase in us, datasheet (AM2320) max with margin.
+ * Missing sensor is detected after TGO_MAX.
+ */
+#define TBE_MAX     50  /* release, line goes high by pullup */
+#define TGO_MAX     200 /* sensor response, 20-200us */
+#define TREL_MAX    100 /* response low, 75-85us */
+#define TREH_MAX    100 /* response high, 75-85us */
+#define TLOW_MAX    75  /* bit start, 48-55us */
+#define THIGH_MAX   100 /* bit data, 22-30us for 0, 68-75us for 1 */
+#define THIGH1_MIN  49  /* high longer than this is 1, if not calibrated */
+/*
+ * Trel+Treh, 150-170us by datasheet. Sensor with clock up to ~50% fast still
+ * calibrates (its 1 is then shorter than THIGH1_MIN), slow one is limited by
+ * TLOW_MAX/THIGH_MAX anyway
+ */
+#define TPRE_MIN    100
+#define TPRE_MAX    180
 #define HIGH    1
 #define LOW     0
 
+/* dht_read_multi(), GPIO0-15 */
+#define DHT_PINS    16
+
+/*
+ * Tbe, start pulse. DHT11 needs at least 18ms, DHT22/AM2320 0.8-20ms,
+ * so one value works for all of them
+ */
+#ifndef DHT_START_MS
+#define DHT_START_MS    18
+#endif
+
 /* Keep it for lower mem usage */
 #define LOWMEM
 
+/* Capture edges by interrupt, instead of polling in critical section */
+//#define IRQ_CAPTURE
+
+/* Critical section, timed with DRV_STATS */
+#ifdef DRV_STATS
+static uint32_t dht_masked_start;
+#endif
+#define DHT_LOCK()      do { portENTER_CRITICAL(); STATS_BEGIN(dht_masked_start); } while (0)
+#define DHT_UNLOCK()    do { STATS_END(STATS_DHT_MASKED, dht_masked_start); portEXIT_CRITICAL(); } while (0)
+
+/* Cycles per us, CPU might run on 80 or 160MHz */
+static uint32_t cycles_us = 80;
+
+static inline uint32_t get_ccount(void) {
+#ifdef HAL_LINUX
+        return(hal_ccount());
+#else
+        uint32_t r;
+        __asm__ __volatile__("rsr     %0, ccount":"=a" (r));
+        return(r);
+#endif
+}
+
+#ifdef IRQ_CAPTURE
+/*
+ * Release, Tgo, Trel, Treh edges, 2 edges per bit, final release by sensor.
+ * Low 16 bits of CCOUNT is enough, longest interval is ~200us
+ */
+#define DHT_EDGES 85
+static volatile uint16_t dht_edge[DHT_EDGES];
+static volatile uint8_t dht_nedge;
+
+/* Application's GPIO handler, gets other pins while frame is read */
+static void (*dht_chain)(void *arg);
+static void *dht_chain_arg;
+
+static void dht_isr(void *arg) {
+        uint32_t status = GPIO_REG_READ(GPIO_STATUS_ADDRESS);
+        uint32_t ccount = get_ccount();
+
+        /* Only our bit is cleared, others are left for chained handler */
+        if (status & (1 << OW_PIN_NUM)) {
+                GPIO_REG_WRITE(GPIO_STATUS_W1TC_ADDRESS, 1 << OW_PIN_NUM);
+                if (dht_nedge < DHT_EDGES)
+                        dht_edge[dht_nedge++] = ccount;
+        }
+        if ((status & ~(1 << OW_PIN_NUM)) && dht_chain)
+                dht_chain(dht_chain_arg);
+}
+
+/*
+ * If application has own GPIO interrupt handler, tell it here instead of
+ * registering it directly. While frame is read handler is called for other
+ * pins, after that it is registered back.
+ */
+void dht_irq_chain(void (*isr)(void *arg), void *arg) {
+        dht_chain = isr;
+        dht_chain_arg = arg;
+        gpio_intr_handler_register(isr, arg);
+}
+#endif
+
 void delay_ms(uint32_t ms) {
         uint32_t i;
         for (i = 0; i < ms; i++)
                 os_delay_us(1000);
 }
 
-/* Return number of cycles it waited for level, or 0 on failure */
-int waittransition(uint level) {
-        int waittime = MAXWAIT-1;
-        while (waittime--) {
+/*
+ * Wait for level, at most timeout us since previous edge (*edge, CCOUNT).
+ * Return cycles since previous edge and store time of this one, 0 on timeout.
+ * Counting from edge, not from call, so code between calls doesn't skew result
+ */
+uint32_t waittransition(uint level, uint32_t timeout, uint32_t *edge) {
+        uint32_t now, limit = timeout * cycles_us;
+
+        do {
+                now = get_ccount();
                 if (OW_GET_IN() == level) {
-                        break;
+                        limit = now - *edge;
+                        *edge = now;
+                        return(limit ? limit : 1);
                 }
+        } while (now - *edge < limit);
+        return(0);
+}
+
+/*
+ * Threshold between 0 (26us) and 1 (70us) high, ~48us, as preamble (160us)
+ * * 0.297, shifts only. Implausible preamble - nominal threshold.
+ */
+static uint32_t dht_threshold(uint32_t pre) {
+        if (pre < TPRE_MIN * cycles_us || pre > TPRE_MAX * cycles_us)
+                return(THIGH1_MIN * cycles_us);
+        return((pre >> 2) + (pre >> 5) + (pre >> 6));
+}
+
+/* Bit value by duration of high part */
+static inline int dht_bit(uint32_t highcycles, uint32_t threshold) {
+        return(highcycles > threshold);
+}
+
+/* Calibration of last single read */
+static dht_cal_t dht_cal;
+
+static inline void dht_calibrate(uint32_t pre) {
+        dht_cal.preamble = pre;
+        dht_cal.threshold = dht_threshold(pre);
+        dht_cal.min1 = 0xFFFFFFFF;
+        dht_cal.max0 = 0;
+}
+
+/* Classify and keep margins, cheap enough for critical section */
+static inline int dht_classify(uint32_t highcycles) {
+        if (dht_bit(highcycles, dht_cal.threshold)) {
+                if (highcycles < dht_cal.min1)
+                        dht_cal.min1 = highcycles;
+                return(1);
+        }
+        if (highcycles > dht_cal.max0)
+                dht_cal.max0 = highcycles;
+        return(0);
+}
+
+/* Threshold and margins (cycles) of last dht_read() */
+void dht_cal_get(dht_cal_t *cal) {
+        *cal = dht_cal;
+}
+
+/* Milli units per unit of last dht_read() result, 100 or 1000 for DHT11 */
+static int dht_unit = 100;
+
+/*
+ * Checksum and conversion, same for single and multi read. Result is in
+ * tenths, DHT11 in whole units, unit tells which one (milli units per unit)
+ */
+static int dht_decode(uint8_t *data, int *temp, int *hum, int *unit) {
+        /* Verify checksum */
+        if (((data[0] + data[1] + data[2] + data[3]) & 0xFF) != data[4])
+          return(2);
+
+        *hum = ((data[0] << 8) + data[1]);
+        *unit = 100;
+
+        /* DHT11 specific, 20-90%RH can't be tenths */
+        if ( *hum > 1000 ) {
+                *hum = data[0];
+                *unit = 1000;
         }
-        if (waittime)
-                return(MAXWAIT-waittime);
-        else
-                return(0);
+
+        *temp = (((data[2] & 0x7F) << 8) + data[3]);
+
+        /* DHT11 specific */
+        if ( *temp > 1250 || *unit == 1000 )
+                *temp = data[2];
+        /* Negative temperature */
+        if ( data[2] & 0x80 )
+                *temp = -*temp;
+
+        return(0);
 }
 
 void dht_init(void) {
@@ -90,82 +279,121 @@ void dht_init(void) {
 int dht_read(int *temp, int *hum) {
         uint8_t data[5];
         int i;
+#ifndef IRQ_CAPTURE
+        uint32_t edge, trel, treh;
+#endif
 
         memset(data, 0x0, 5);
+        cycles_us = system_get_cpu_freq();
         /* Not in specs, but device should see transition from low to high
            Might be reduced
         */
         OW_OUT_HIGH();
         delay_ms(25);
 
-        /* Tbe, you may adjust delay to 80us-20ms, esp. if you have
-         *  high capacitance on data line, or its long. By specs at least 80us
+        /* Tbe, see DHT_START_MS, longer one helps esp. if you have
+         *  high capacitance on data line, or its long
          */
         OW_OUT_LOW();
-        delay_ms(5);
+        delay_ms(DHT_START_MS);
+#ifdef IRQ_CAPTURE
+        dht_nedge = 0;
+        GPIO_REG_WRITE(GPIO_STATUS_W1TC_ADDRESS, 1 << OW_PIN_NUM);
+        gpio_intr_handler_register(dht_isr, NULL);
+        gpio_pin_intr_state_set(GPIO_ID_PIN(OW_PIN_NUM), GPIO_PIN_INTR_ANYEDGE);
+        _xt_isr_unmask(1 << ETS_GPIO_INUM);
+        OW_DIR_IN();
+        /* Whole frame is less than 6ms, at least one full tick more */
+        vTaskDelay(10 / portTICK_RATE_MS + 1);
+        gpio_pin_intr_state_set(GPIO_ID_PIN(OW_PIN_NUM), GPIO_PIN_INTR_DISABLE);
+        GPIO_REG_WRITE(GPIO_STATUS_W1TC_ADDRESS, 1 << OW_PIN_NUM);
+        if (dht_chain)
+                gpio_intr_handler_register(dht_chain, dht_chain_arg);
+        {
+                /* First edge (release) might be missed, count from the end */
+                int base = dht_nedge - DHT_EDGES;
+                uint16_t highcycles;
+
+                if (base != 0 && base != -1)
+                        return(1);
+
+                /* Preamble, Trel from edge 1, Treh till edge 3 */
+                dht_calibrate((uint16_t)(dht_edge[base+3] - dht_edge[base+1]));
+                for (i=0; i<40; ++i) {
+                        /* bit i: low from edge 3+2i, high from 4+2i till 5+2i */
+                        highcycles = dht_edge[base+5+2*i] - dht_edge[base+4+2*i];
+                        data[i/8] <<= 1;
+                        data[i/8] |= dht_classify(highcycles);
+                }
+        }
+#else
         /* Time critical part might introduce lag to your realtime functions
         * Best (ideal) case lag 2950us, worst case 5370us, with non-critical
         * section (but it is "schedulable") ~30ms
         */
 #ifdef LOWMEM
-        portENTER_CRITICAL();
+        DHT_LOCK();
         OW_DIR_IN();
+        edge = get_ccount();
         /* Tbe, to Tgo, might be <= 1 */
-        if (!waittransition(HIGH))
+        if (!waittransition(HIGH, TBE_MAX, &edge))
                 goto bad;
 
         /* Tgo, to Trel */
-        if (!waittransition(LOW))
+        if (!waittransition(LOW, TGO_MAX, &edge))
                 goto bad;
 
         /* Trel, to Treh */
-        if (!waittransition(HIGH))
+        if (!(trel = waittransition(HIGH, TREL_MAX, &edge)))
                 goto bad;
 
         /* Treh, to first byte Tlow */
-        if (!waittransition(LOW))
+        if (!(treh = waittransition(LOW, TREH_MAX, &edge)))
                 goto bad;
+        dht_calibrate(trel + treh);
         {
-                int lowcycles, highcycles;
+                uint32_t lowcycles, highcycles;
                 for (i=0; i<40; ++i) {
-                        lowcycles   = waittransition(HIGH);
-                        highcycles  = waittransition(LOW);
+                        lowcycles   = waittransition(HIGH, TLOW_MAX, &edge);
+                        highcycles  = waittransition(LOW, THIGH_MAX, &edge);
+                        if (!lowcycles || !highcycles)
+                                goto bad;
                         data[i/8] <<= 1;
-                        if (highcycles > lowcycles)
-                                data[i/8] |= 1;
+                        data[i/8] |= dht_classify(highcycles);
                 }
         }
 
-        portEXIT_CRITICAL();
+        DHT_UNLOCK();
 #else
         /* Don't add anything here, time critical code */
-        portENTER_CRITICAL();
+        DHT_LOCK();
         uint32_t cycles[80];
         {
                 OW_DIR_IN();
+                edge = get_ccount();
                 /* Tbe, to Tgo, might be <= 1 */
-                if (!waittransition(HIGH))
+                if (!waittransition(HIGH, TBE_MAX, &edge))
                         goto bad;
 
                 /* Tgo, to Trel */
-                if (!waittransition(LOW))
+                if (!waittransition(LOW, TGO_MAX, &edge))
                         goto bad;
 
                 /* Trel, to Treh */
-                if (!waittransition(HIGH))
+                if (!(trel = waittransition(HIGH, TREL_MAX, &edge)))
                         goto bad;
 
                 /* Treh, to first byte Tlow */
-                if (!waittransition(LOW))
+                if (!(treh = waittransition(LOW, TREH_MAX, &edge)))
                         goto bad;
 
                 /* Each bit, [i] duration of low pulse, [i+1] - high pulse */
                 for (i=0; i<80; i+=2) {
-                        cycles[i]   = waittransition(HIGH);
-                        cycles[i+1] = waittransition(LOW);
+                        cycles[i]   = waittransition(HIGH, TLOW_MAX, &edge);
+                        cycles[i+1] = waittransition(LOW, THIGH_MAX, &edge);
                 }
         }
-        portEXIT_CRITICAL();
+        DHT_UNLOCK();
 
         /*
            // In case you want to debug received timing values
@@ -173,6 +401,7 @@ int dht_read(int *temp, int *hum) {
          */
 
         /* Time critical finished, processing data */
+        dht_calibrate(trel + treh);
         for (i=0; i<40; ++i) {
                 uint32_t lowCycles  = cycles[2*i];
                 uint32_t highCycles = cycles[2*i+1];
@@ -180,35 +409,120 @@ int dht_read(int *temp, int *hum) {
                 if ((lowCycles == 0) || (highCycles == 0)) {
                         return(1);
                 }
-                /* Add bits for each byte if high cycle is more than low */
+                /* Add bits for each byte by duration of high */
                 data[i/8] <<= 1;
-                if (highCycles > lowCycles) {
-                        data[i/8] |= 1;
-                }
+                data[i/8] |= dht_classify(highCycles);
         }
 #endif
+#endif /* IRQ_CAPTURE */
 
-        /* Verify checksum */
-        if (((data[0] + data[1] + data[2] + data[3]) & 0xFF) != data[4])
-          return(2);
+        return(dht_decode(data, temp, hum, &dht_unit));
+#ifndef IRQ_CAPTURE
+bad:
+        DHT_UNLOCK();
+        return(1);
+#endif
+}
 
-        *hum = ((data[0] << 8) + data[1]);
+/* Same as dht_read(), in milli C and milli %RH as other sensor drivers */
+int dht_read_mc(int32_t *temp, int32_t *hum) {
+        int t, h, r;
 
-        /* DHT11 specific */
-        if ( *hum > 1000 )
-                *hum = data[0];
+        r = dht_read(&t, &h);
+        if (r)
+                return(r);
+        *temp = t * dht_unit;
+        *hum = h * dht_unit;
+        return(0);
+}
 
-        *temp = (((data[2] & 0x7F) << 8) + data[3]);
+/*
+ * Read sensors on all pins in mask (GPIO0-15) at once, pins must be set to GPIO
+ * function and have pullups (see list above). temp, hum (milli C, milli %RH)
+ * and status are arrays indexed by pin number, status is 0 on success, 1 -
+ * no/broken frame, 2 - checksum, as dht_read() returns. Returns mask of pins
+ * read successfully.
+ *
+ * Edges are numbered as in IRQ_CAPTURE: 0 release, 1-3 response, bit i is high
+ * from edge 4+2i to 5+2i. Each pin gets own threshold from its preamble.
+ * Each bit is decoded as its falling edge is seen, so loop keeps only few
+ * bytes per pin. Loop ends when all frames are complete or line was quiet on
+ * all pins longer than sensor may keep it (TGO_MAX).
+ */
+uint32_t dht_read_multi(uint32_t mask, int32_t *temp, int32_t *hum, int *status) {
+        uint8_t data[DHT_PINS][5];
+        uint8_t nedge[DHT_PINS];
+        uint32_t last[DHT_PINS];
+        uint32_t thr[DHT_PINS];
+        uint32_t in, prev, changed, done, quiet, now, ok;
+        int pin, i, t, h, unit;
 
-        /* DHT11 specific */
-        if ( *temp > 1250 )
-                *temp = data[2];
-        /* Negative temperature */
-        if ( data[2] & 0x80 )
-                *temp = -*temp;
+        mask &= (1 << DHT_PINS) - 1;
+        memset(data, 0, sizeof(data));
+        memset(nedge, 0, sizeof(nedge));
+        cycles_us = system_get_cpu_freq();
+        quiet = TGO_MAX * cycles_us;
 
-        return(0);
-bad:
-        portEXIT_CRITICAL();
-        return(1);
+        GPIO_REG_WRITE(GPIO_OUT_W1TS_ADDRESS, mask);
+        GPIO_REG_WRITE(GPIO_ENABLE_W1TS_ADDRESS, mask);
+        delay_ms(25);
+        GPIO_REG_WRITE(GPIO_OUT_W1TC_ADDRESS, mask);
+        delay_ms(DHT_START_MS);
+
+        /* Time critical, only edge bookkeeping inside */
+        DHT_LOCK();
+        GPIO_REG_WRITE(GPIO_ENABLE_W1TC_ADDRESS, mask);
+        /* Master was holding all of them low */
+        prev = 0;
+        done = 0;
+        now = get_ccount();
+        for (pin = 0; pin < DHT_PINS; pin++)
+                last[pin] = now;
+        ok = now;
+        do {
+                now = get_ccount();
+                in = GPIO_REG_READ(GPIO_IN_ADDRESS) & mask;
+                changed = (in ^ prev) & ~done;
+                prev = in;
+                if (!changed)
+                        continue;
+                ok = now;
+                for (pin = 0; changed; pin++, changed >>= 1) {
+                        if (!(changed & 1))
+                                continue;
+                        i = nedge[pin]++;
+                        /* Preamble from Trel start to Treh end, per sensor */
+                        if (i == 1)
+                                thr[pin] = now;
+                        else if (i == 3)
+                                thr[pin] = dht_threshold(now - thr[pin]);
+                        /* Falling edge at end of bit high */
+                        else if (i >= 5 && (i & 1)) {
+                                i = (i - 5) / 2;
+                                data[pin][i/8] <<= 1;
+                                data[pin][i/8] |= dht_bit(now - last[pin], thr[pin]);
+                                if (i == 39)
+                                        done |= 1 << pin;
+                        }
+                        last[pin] = now;
+                }
+        } while (done != mask && now - ok < quiet);
+        DHT_UNLOCK();
+
+        ok = 0;
+        for (pin = 0; pin < DHT_PINS; pin++) {
+                if (!(mask & (1 << pin)))
+                        continue;
+                if (!(done & (1 << pin))) {
+                        status[pin] = 1;
+                        continue;
+                }
+                status[pin] = dht_decode(data[pin], &t, &h, &unit);
+                if (status[pin])
+                        continue;
+                temp[pin] = t * unit;
+                hum[pin] = h * unit;
+                ok |= 1 << pin;
+        }
+        return(ok);
 }
@@ -1,7 +1,12 @@
+#ifdef HAL_LINUX
+#include "hal.h"
+#else
 #include "esp_common.h"
 #include <fcntl.h>
 #include <stdio.h>
 #include <gpio.h>
+#endif
+#include "stats.h"
 /*
    GPIO0:	PERIPHS_IO_MUX_GPIO0_U
    GPIO1:	PERIPHS_IO_MUX_U0TXD_U
@@ -28,19 +33,29 @@
 #define OW_OUT_HIGH() ( GPIO_OUTPUT_SET(GPIO_ID_PIN(OW_PIN_NUM), 1) )
 #define OW_DIR_IN()   ( GPIO_DIS_OUTPUT(GPIO_ID_PIN(OW_PIN_NUM)) )
 
+/* Critical section, timed with DRV_STATS */
+#ifdef DRV_STATS
+static uint32_t ds_masked_start, ds_reset_start;
+#endif
+#define DS_LOCK()     do { portENTER_CRITICAL(); STATS_BEGIN(ds_masked_start); } while (0)
+#define DS_UNLOCK()   do { STATS_END(STATS_DS_MASKED, ds_masked_start); portEXIT_CRITICAL(); } while (0)
+
 // OK if just using a single permanently connected device
 int onewire_reset() {
         int r;
+        STATS_BEGIN(ds_reset_start);
         PIN_FUNC_SELECT(PERIPHS_IO_MUX_GPIO4_U, FUNC_GPIO4);
         PIN_PULLUP_DIS(PERIPHS_IO_MUX_GPIO4_U);
-        portENTER_CRITICAL();
         OW_OUT_LOW();
         os_delay_us(480);
+        /* Only presence sample is time critical */
+        DS_LOCK();
         OW_DIR_IN();
         os_delay_us(70);
         r = OW_GET_IN(); // Is OW device present it will pull low
-        portEXIT_CRITICAL();
+        DS_UNLOCK();
         os_delay_us(410); // TODO: Why?
+        STATS_END(STATS_DS_RESET, ds_reset_start);
         // if r - 1 - bad, means device didnt pulled low
         return(r);
 }
@@ -58,36 +73,38 @@ void onewire_write(int data) {
         int count, temp;
 
         for (count=0; count<8; ++count) {
-                portENTER_CRITICAL();
+                DS_LOCK();
                 temp = data>>count;
                 temp &= 0x1;
+                /* Recovery part of slot with interrupts enabled */
                 if (temp) {
                         OW_OUT_LOW();
                         os_delay_us(10);
                         OW_OUT_HIGH();
+                        DS_UNLOCK();
                         os_delay_us(55);
                 } else {
                         OW_OUT_LOW();
                         os_delay_us(65);
                         OW_OUT_HIGH();
+                        DS_UNLOCK();
                         os_delay_us(5);
                 }
-                portEXIT_CRITICAL();
         }
 }
 
 int onewire_read() {
         int count, data = 0;
         for (count=0; count<8; ++count) {
-                portENTER_CRITICAL();
+                DS_LOCK();
                 OW_OUT_LOW();
                 os_delay_us(3);
                 OW_DIR_IN();
                 os_delay_us(10);
                 if (OW_GET_IN())
                         data |= (1<<count);
+                DS_UNLOCK();
                 os_delay_us(53);
-                portEXIT_CRITICAL();
         }
         return( data );
 }
@@ -141,5 +158,6 @@ int ds1820_read() {
         }
         // default is 12 bit resolution, 750 ms conversion time
         // we get YXXX - where it is Y.XXX * 1000 to avoid float
-        return(raw * 1000 / 16);
+        // raw * 1000 / 16, without division
+        return((raw * 125) >> 1);
 }
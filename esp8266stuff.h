@@ -1,6 +1,305 @@
 #include <stdint.h>
 
 void parse_http(uint8_t *state, char *buf, int *size, void *callback);
-int ds1820_read(void);
+
+/* microhttpclient.c, incremental response parser */
+#define HP_STATUS       0
+#define HP_HEADER       1
+#define HP_NAME         2
+#define HP_VALUE        3
+#define HP_BODY         4
+#define HP_BODY_CLOSE   5
+#define HP_CHUNK_SIZE   6
+#define HP_CHUNK_EXT    7
+#define HP_CHUNK_DATA   8
+#define HP_CHUNK_CRLF   9
+#define HP_TRAILER      10
+#define HP_DONE         11
+#define HP_ERROR        255
+
+#define HTTP_11         0x01
+#define HTTP_LENGTH     0x02
+#define HTTP_CHUNKED    0x04
+#define HTTP_CLOSE      0x08
+#define HTTP_KEEPALIVE  0x10
+#define HTTP_NOBODY     0x20    /* set before parsing response to HEAD */
+
+/* Parts of header passed to header callback */
+#define HTTP_HDR_NAME   0
+#define HTTP_HDR_VALUE  1
+#define HTTP_HDR_END    2
+
+#define HTTP_ETAG_LEN   48
+#define HTTP_DATE_LEN   32
+
+typedef struct {
+    char etag[HTTP_ETAG_LEN];       /* as server sent it, with quotes */
+    char modified[HTTP_DATE_LEN];   /* Last-Modified */
+} http_validator_t;
+
+typedef struct {
+    uint8_t state;
+    uint8_t flags;
+    uint8_t hdr;
+    uint8_t cand;
+    uint8_t pos;
+    uint8_t pos2;
+    uint8_t lead;           /* skipping whitespace before header value */
+    int status;
+    uint32_t length;        /* Content-Length or rest of chunk */
+    uint32_t length1;       /* earlier Content-Length, repeated one must match */
+    void (*body)(void *ctx, char *buf, int len);
+    void (*header)(void *ctx, int part, char *buf, int len);
+    http_validator_t *valid;
+    void *ctx;
+} http_parser_t;
+
+void http_parser_init(http_parser_t *p, void (*body)(void *, char *, int), void *ctx);
+void http_parser_headers(http_parser_t *p, void (*header)(void *, int, char *, int));
+void http_parser_validators(http_parser_t *p, http_validator_t *v);
+int http_parse(http_parser_t *p, char *buf, int size);
+int http_keepalive(http_parser_t *p);
+
+/* microhttpclient.c, request builder and pipelining */
+typedef struct {
+    char *buf;
+    int size;
+    int len;
+    int overflow;
+} http_req_t;
+
+typedef struct {
+    http_parser_t parser;
+    int pending;            /* requests sent, waiting for response */
+    uint32_t nobody;        /* bit per pending request, HEAD */
+    void (*complete)(void *ctx, int status, int keepalive);
+    void *ctx;
+} http_pipe_t;
+
+void http_req_begin(http_req_t *r, char *buf, int size, const char *method, const char *host, const char *path);
+void http_req_header(http_req_t *r, const char *name, const char *value);
+int http_req_end(http_req_t *r, const char *body, int len);
+void http_pipe_init(http_pipe_t *pp, void (*body)(void *, char *, int),
+                    void (*complete)(void *, int, int), void *ctx);
+void http_pipe_sent(http_pipe_t *pp, int flags);
+int http_pipe_feed(http_pipe_t *pp, char *buf, int size);
+int http_pipe_eof(http_pipe_t *pp);
+
+/* microhttpclient.c, ETag/Last-Modified cache, 3 sectors from sec */
+#define HTTP_CACHE_URLS 4
+
+typedef struct {
+    uint32_t url;           /* hash of host and path, 0 - free */
+    uint32_t used;          /* for replacement */
+    http_validator_t v;
+} http_cache_entry_t;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t used;
+    http_cache_entry_t e[HTTP_CACHE_URLS];
+    uint16_t sec;
+    uint16_t dirty;
+} http_cache_t;
+
+int http_cache_load(http_cache_t *c, uint16_t sec);
+http_validator_t *http_cache_get(http_cache_t *c, const char *host, const char *path);
+void http_req_conditional(http_req_t *r, const http_validator_t *v);
+int http_cache_update(http_cache_t *c, http_validator_t *v, const http_validator_t *fresh, int status);
+int http_cache_save(http_cache_t *c);
+
+/* ota.c, firmware image sink for http_parse() body */
+#define OTA_SECTOR      4096
+
+typedef struct {
+    uint32_t addr;          /* flash address of image, sector aligned */
+    uint32_t size;          /* bytes received */
+    uint32_t crc;           /* CRC32 of received data */
+    uint8_t *buf[2];
+    uint16_t fill;          /* bytes in buf[cur] */
+    uint8_t cur;
+    volatile int error;
+    void *todo;             /* queue of buffers to write */
+    void *done;             /* queue of free buffers */
+} ota_sink_t;
+
+uint32_t crc32_update(uint32_t crc, const uint8_t *buf, uint32_t len);
+int ota_sink_begin(ota_sink_t *s, uint32_t addr);
+void ota_sink_write(void *ctx, char *buf, int len);
+int ota_sink_finish(ota_sink_t *s);
+int ds1820_read(double *temp);
+int ds1820_read_mc(int32_t *temp);
 int dht_read(int *temp, int *hum);
 void dht_init(void);
+/* dht.c, bit threshold calibrated by preamble, cycles */
+typedef struct {
+    uint32_t preamble;      /* Trel+Treh measured */
+    uint32_t threshold;     /* high longer than this is 1 */
+    uint32_t min1;          /* shortest 1, margin is min1 - threshold */
+    uint32_t max0;          /* longest 0, margin is threshold - max0 */
+} dht_cal_t;
+
+void dht_cal_get(dht_cal_t *cal);
+int dht_read_mc(int32_t *temp, int32_t *hum);
+uint32_t dht_read_multi(uint32_t mask, int32_t *temp, int32_t *hum, int *status);
+/* dht.c with IRQ_CAPTURE, application GPIO handler kept while reading */
+void dht_irq_chain(void (*isr)(void *arg), void *arg);
+
+/* ow.c, command sequence as one transaction, onewire_transaction() */
+#define OW_XFER_MAX     32      /* ROM command, ROM, function command and data */
+#define OW_XFER_CRC8    0x01    /* last byte read is CRC8 of ones before */
+
+typedef struct {
+    const uint8_t *rom;     /* MATCH ROM, NULL - SKIP ROM */
+    uint8_t cmd;            /* function command */
+    uint8_t flags;
+    uint8_t wlen;           /* bytes from wr written after cmd */
+    uint8_t rlen;           /* bytes read into rd after that */
+    const uint8_t *wr;
+    uint8_t *rd;
+} onewire_xfer_t;
+
+/* ow.c, multiple devices on one bus */
+typedef struct {
+    uint8_t rom[8];
+    int last_discrepancy;
+    int last_device;
+    uint8_t cmd;            /* 0xF0 (or 0) SEARCH ROM, 0xEC ALARM SEARCH */
+} onewire_search_t;
+
+typedef struct {
+    uint8_t rom[8];
+    int status;
+    int32_t temp;           /* milli C */
+    /* Profile, filled once by ds1820_profile(), cleared on CRC error or no presence */
+    uint8_t valid;
+    uint8_t cfg;            /* resolution bits of config, 0x60 for DS1820 */
+    uint8_t powered;        /* externally powered */
+    uint8_t verified;       /* resolution checked (and fixed) once */
+} ds1820_dev_t;
+
+/* ow.c, non-blocking conversion */
+#define DS1820_IDLE       0
+#define DS1820_CONVERTING 1
+#define DS1820_READY      2
+#define DS1820_ERROR      3
+
+typedef struct {
+    const uint8_t *rom;     /* NULL - SKIP ROM, single device or broadcast */
+    uint8_t family;         /* used if rom is NULL */
+    uint8_t cfg;            /* last known config byte, 0x60 if unknown */
+    uint8_t powered;        /* externally powered, can poll read slots */
+    uint8_t state;
+    uint32_t start;
+    uint32_t wait;
+} ds1820_conv_t;
+
+#define OW_SPEED_STANDARD   0
+#define OW_SPEED_OVERDRIVE  1
+
+int onewire_uart_setup(void);
+int onewire_power_up(void);
+void onewire_power_down(void);
+void onewire_deep_sleep(uint64_t us);
+void onewire_set_speed(int speed);
+int onewire_overdrive_skip(void);
+int onewire_overdrive_match(const uint8_t *rom);
+void onewire_lock(void);
+void onewire_unlock(void);
+uint8_t crc8_update(uint8_t crc, const uint8_t *buffer, uint8_t length);
+uint8_t crc8_data(uint8_t *buffer, uint8_t length);
+uint16_t crc16_update(uint16_t crc, const uint8_t *buffer, uint16_t length);
+int crc16_check(const uint8_t *buffer, uint16_t length, const uint8_t *inverted);
+/* ow.c, bit parallel multi bus, arrays indexed by GPIO number, GPIO16 not */
+#define OW_MULTI_PINS       16
+
+void onewire_multi_setup(uint32_t mask);
+uint32_t onewire_multi_reset(uint32_t mask);
+void onewire_multi_write_bit(uint32_t mask, uint32_t ones);
+uint32_t onewire_multi_read_bit(uint32_t mask);
+void onewire_multi_write(uint32_t mask, int data);
+void onewire_multi_read(uint32_t mask, uint8_t *data);
+uint32_t ds1820_multi_read(uint32_t mask, int32_t *temp, int *status);
+void onewire_search_reset(onewire_search_t *s);
+void onewire_alarm_search_reset(onewire_search_t *s);
+int onewire_search(onewire_search_t *s);
+int onewire_search_all(uint8_t (*roms)[8], int max);
+int onewire_alarm_search_all(uint8_t (*roms)[8], int max);
+void onewire_select(const uint8_t *rom);
+int onewire_transaction(const onewire_xfer_t *x);
+int ds1820_sweep(ds1820_dev_t *devs, int count);
+int ds1820_set_alarm(const uint8_t *rom, int8_t th, int8_t tl, int save);
+int ds1820_alarm_scan(ds1820_dev_t *devs, int count, uint8_t (*roms)[8], int max);
+int ds1820_fetch(ds1820_dev_t *dev);
+int ds1820_profile(ds1820_dev_t *dev);
+int ds1820_powered(const uint8_t *rom);
+int ds1820_start(ds1820_conv_t *c);
+int ds1820_poll(ds1820_conv_t *c);
+int ds1820_wait(ds1820_conv_t *c);
+int ds1820_complete(ds1820_conv_t *c, int32_t *temp);
+
+/* sampler.c, background sampling with cached values */
+#define SAMPLER_MAX         16
+#define SAMPLER_DHT         1
+#define SAMPLER_DS1820      2
+
+typedef struct {
+    int status;             /* 0 ok, driver error code, -1 not sampled yet */
+    uint32_t time;          /* tick count when sampled */
+    int32_t temp;           /* milli C */
+    int32_t hum;            /* milli %RH, DHT only */
+} sampler_value_t;
+
+int sampler_add_dht(int pin, uint32_t interval_ms);
+int sampler_add_ds1820(const uint8_t *rom, uint32_t interval_ms);
+uint32_t sampler_step(void);
+int sampler_start(void);
+int sampler_get(int id, sampler_value_t *v);
+
+/* telemetry.c, compact batches of readings */
+#define TLM_RAW             0
+#define TLM_CBOR            1
+#define TLM_SENSORS         16
+#define TLM_DHT_ID(pin)     ( (uint64_t)(pin) )
+#define TLM_HAS_HUM(id)     ( (id) < 256 )  /* DHT, ROM codes are never that low */
+
+typedef struct {
+    uint64_t id;            /* tlm_rom_id() or TLM_DHT_ID() */
+    uint32_t time;
+    int32_t temp;           /* milli C */
+    int32_t hum;            /* milli %RH, DHT only */
+} tlm_reading_t;
+
+typedef struct {
+    uint64_t id;
+    uint32_t time;
+    int32_t delta;          /* last time delta */
+    int32_t temp;
+    int32_t hum;
+} tlm_sensor_t;
+
+typedef struct {
+    uint8_t *buf;
+    int size;
+    int len;
+    int format;
+    int count;              /* readings in batch */
+    uint32_t time;          /* time of last reading */
+    int nsensors;
+    tlm_sensor_t s[TLM_SENSORS];
+} tlm_enc_t;
+
+uint64_t tlm_rom_id(const uint8_t *rom);
+int tlm_begin(tlm_enc_t *e, uint8_t *buf, int size, int format);
+int tlm_add(tlm_enc_t *e, const tlm_reading_t *r);
+int tlm_end(tlm_enc_t *e);
+int tlm_decode(const uint8_t *buf, int len, void (*cb)(void *ctx, const tlm_reading_t *r), void *ctx);
+
+/* rlog.c, store and forward log in RTC memory and flash */
+int rlog_init(uint16_t sec);
+int rlog_append(const tlm_reading_t *r);
+int rlog_flush(void);
+int rlog_pending(void);
+uint32_t rlog_tail(void);
+int rlog_read(uint32_t *pos, tlm_reading_t *r, int max);
+int rlog_ack(uint32_t pos);
@@ -0,0 +1,264 @@
+/*
+ * Copyright (C) 2017, Denys Fedoryshchenko
+ * Contact: <nuclearcat@nuclearcat.com>
+ * Licensed under the GPLv2
+ * <http://www.gnu.org/licenses/old-licenses/gpl-2.0.txt>
+ *
+ * Small HAL to run drivers on Linux (build with -DHAL_LINUX)
+ * On ESP8266 drivers use SDK directly, so ESP "backend" is SDK itself and
+ * nothing changes there. On Linux this header gives same names (pin access,
+ * delays, critical sections, ticks) backed by hal_linux.c, which keeps virtual
+ * clock in CPU cycles (80MHz) and simulated devices attached to pins
+ * (sim_ow.c - DS1820/DS18B20, sim_dht.c - DHT22/AM2320/DHT11).
+ *
+ * Time passes only in delays and a bit on each pin access (HAL_IO_CYCLES),
+ * so results are deterministic and don't depend on host speed.
+ */
+#ifndef HAL_H
+#define HAL_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define HAL_CPU_MHZ     80
+#define HAL_IO_CYCLES   8       /* cost of one GPIO register access */
+#define HAL_US(x)       ( (uint64_t)((x) * HAL_CPU_MHZ) )
+
+/* Virtual clock, CPU cycles */
+uint64_t hal_time(void);
+void hal_advance(uint64_t cycles);
+uint32_t hal_ccount(void);
+
+/* Master side of pin, level seen on pin is wired AND with devices */
+void hal_pin_set(int pin, int level);
+void hal_pin_dir(int pin, int out);
+int hal_pin_get(int pin);
+
+/* Many pins in one register access, like GPIO.out_w1ts/GPIO.in */
+void hal_mask_set(uint32_t mask, int level);
+void hal_mask_dir(uint32_t mask, int out);
+uint32_t hal_in(void);
+
+/* Critical sections, nestable, masked time is accounted at outer level */
+void hal_lock(void);
+void hal_unlock(void);
+
+/* Per transaction accounting, reset before, read after */
+typedef struct {
+    uint64_t cycles;        /* virtual time passed */
+    uint64_t masked;        /* with interrupts masked */
+    uint64_t masked_max;    /* longest single masked window */
+    uint32_t locks;         /* number of masked windows */
+} hal_stats_t;
+
+void hal_stats_reset(void);
+void hal_stats_get(hal_stats_t *st);
+
+/*
+ * Simulated device on a pin. edge() is called when master starts (level 0) or
+ * stops (level 1) pulling line low, level() returns 0 if device pulls line
+ * low at time t. drive() (may be NULL) when master starts (1) or stops (0)
+ * driving line high, strong pullup
+ */
+typedef struct sim_dev {
+    int pin;
+    void (*edge)(struct sim_dev *d, int level, uint64_t t);
+    int (*level)(struct sim_dev *d, uint64_t t);
+    void (*drive)(struct sim_dev *d, int high, uint64_t t);
+    struct sim_dev *next;
+} sim_dev_t;
+
+void hal_sim_attach(sim_dev_t *d, int pin);
+void hal_sim_detach(sim_dev_t *d);
+
+/* sim_ow.c */
+sim_dev_t *sim_ow_add(int pin, uint8_t family, uint64_t serial, int32_t temp_mc);
+void sim_ow_set_temp(sim_dev_t *d, int32_t temp_mc);
+void sim_ow_set_parasite(sim_dev_t *d, int parasite);
+void sim_ow_set_overdrive(sim_dev_t *d, int capable);
+const uint8_t *sim_ow_rom(sim_dev_t *d);
+
+/* sim_dht.c, type 11 or 22 (AM2320 is same as 22) */
+sim_dev_t *sim_dht_add(int pin, int type, int temp, int hum);
+void sim_dht_set(sim_dev_t *d, int temp, int hum);
+void sim_dht_timing(sim_dev_t *d, int clock, int jitter);
+
+/* UART with TX open drain and RX both on pin, so RX gets echo of bus */
+void hal_uart_attach(int port, int pin);
+
+/* File backed SPI flash, erased (0xFF) if file is new */
+int hal_flash_open(const char *path, uint32_t size);
+
+/* File backed RTC memory, kept like in deep sleep, file removed - cold boot */
+int hal_rtc_open(const char *path);
+
+/* SDK names used by drivers */
+typedef unsigned int uint;
+typedef uint8_t uint8;
+typedef uint16_t uint16;
+typedef uint32_t uint32;
+typedef int32_t int32;
+typedef uint32_t TickType_t;
+typedef int gpio_num_t;
+typedef int gpio_mode_t;
+
+#define IRAM_ATTR
+#define ICACHE_FLASH_ATTR
+#define portTICK_RATE_MS    10
+#define portTICK_PERIOD_MS  portTICK_RATE_MS
+
+void vTaskDelay(TickType_t ticks);
+TickType_t xTaskGetTickCount(void);
+void os_delay_us(uint32_t us);
+uint8_t system_get_cpu_freq(void);
+void esp_deep_sleep(uint64_t us);
+
+/*
+ * Tasks and queues. Each task is a thread, but only one runs at a time: it
+ * keeps CPU till it blocks on queue or ends, so virtual clock stays
+ * consistent. Queues block forever (portMAX_DELAY) or not at all.
+ */
+typedef void *xQueueHandle;
+typedef void *xTaskHandle;
+
+#define portMAX_DELAY       0xFFFFFFFF
+#define pdPASS              1
+#define pdTRUE              1
+#define pdFALSE             0
+
+xQueueHandle xQueueCreate(uint32_t len, uint32_t item_size);
+void vQueueDelete(xQueueHandle q);
+int xQueueSend(xQueueHandle q, const void *item, TickType_t ticks);
+int xQueueReceive(xQueueHandle q, void *item, TickType_t ticks);
+int xTaskCreate(void (*fn)(void *), const signed char *name, uint16_t stack, void *arg, uint32_t prio, xTaskHandle *h);
+void vTaskDelete(xTaskHandle h);
+
+#define vPortETSIntrLock()      hal_lock()
+#define vPortETSIntrUnlock()    hal_unlock()
+#define portENTER_CRITICAL()    hal_lock()
+#define portEXIT_CRITICAL()     hal_unlock()
+
+#define ESP_LOGE(tag, fmt, ...) printf("E %s: " fmt "\n", tag, ##__VA_ARGS__)
+#define ESP_LOGW(tag, fmt, ...) printf("W %s: " fmt "\n", tag, ##__VA_ARGS__)
+#define ESP_LOGI(tag, fmt, ...) printf("I %s: " fmt "\n", tag, ##__VA_ARGS__)
+
+/* New SDK (ow.c) */
+#define GPIO_INTR_DISABLE   0
+#define GPIO_MODE_INPUT     1
+#define GPIO_MODE_OUTPUT    2
+
+typedef struct {
+    int intr_type;
+    int mode;
+    uint64_t pin_bit_mask;
+    int pull_down_en;
+    int pull_up_en;
+} gpio_config_t;
+
+int gpio_config(const gpio_config_t *conf);
+int gpio_set_direction(gpio_num_t pin, gpio_mode_t mode);
+int gpio_set_level(gpio_num_t pin, uint32_t level);
+
+#define ESP_OK              0
+#define UART_NUM_0          0
+#define UART_NUM_1          1
+#define UART_DATA_8_BITS    3
+#define UART_PARITY_DISABLE 0
+#define UART_STOP_BITS_1    1
+#define UART_HW_FLOWCTRL_DISABLE 0
+
+typedef int uart_port_t;
+
+typedef struct {
+    int baud_rate;
+    int data_bits;
+    int parity;
+    int stop_bits;
+    int flow_ctrl;
+} uart_config_t;
+
+int uart_param_config(uart_port_t port, const uart_config_t *conf);
+int uart_driver_install(uart_port_t port, int rx_size, int tx_size, int queue_size, void *queue, int no_use);
+int uart_set_baudrate(uart_port_t port, uint32_t baud);
+int uart_write_bytes(uart_port_t port, const char *src, size_t size);
+int uart_read_bytes(uart_port_t port, uint8_t *buf, uint32_t length, TickType_t ticks);
+int uart_flush_input(uart_port_t port);
+int uart_enable_swap(void);
+
+static inline void fast_pin_set(gpio_num_t pin, uint32_t level) { hal_pin_set(pin, level); }
+static inline int fast_pin_get(gpio_num_t pin) { return hal_pin_get(pin); }
+static inline void fast_pin_dir(gpio_num_t pin, gpio_mode_t mode) { hal_pin_dir(pin, mode); }
+static inline void fast_mask_set(uint32_t mask, uint32_t level) { hal_mask_set(mask, level); }
+static inline void fast_mask_dir(uint32_t mask, gpio_mode_t mode) { hal_mask_dir(mask, mode); }
+static inline uint32_t fast_in(void) { return hal_in(); }
+static inline void WaitCycles(uint32_t delta) { hal_advance(delta); }
+static inline uint32_t GetCycleCount(void) { return (uint32_t)hal_time(); }
+static inline void WaitUntilCycle(uint32_t until) {
+    int32_t d = until - (uint32_t)hal_time();
+    if (d > 0)
+        hal_advance(d);
+}
+
+/* Old SDK (dht.c, ds18b20.c, microhttpclient.c, ota.c) */
+typedef enum {
+    SPI_FLASH_RESULT_OK,
+    SPI_FLASH_RESULT_ERR,
+    SPI_FLASH_RESULT_TIMEOUT
+} SpiFlashOpResult;
+
+#define SPI_FLASH_SEC_SIZE  4096
+
+SpiFlashOpResult spi_flash_erase_sector(uint16_t sec);
+SpiFlashOpResult spi_flash_write(uint32_t addr, uint32_t *src, uint32_t size);
+SpiFlashOpResult spi_flash_read(uint32_t addr, uint32_t *dst, uint32_t size);
+
+/* Parameter area of 3 sectors: two copies and flag which one is valid */
+bool system_param_save_with_protect(uint16_t start_sec, void *param, uint16_t len);
+bool system_param_load(uint16_t start_sec, uint16_t offset, void *param, uint16_t len);
+
+/* RTC memory in 4 byte blocks, 64-191 for user */
+bool system_rtc_mem_write(uint8_t des_addr, const void *src_addr, uint16_t save_size);
+bool system_rtc_mem_read(uint8_t src_addr, void *des_addr, uint16_t load_size);
+
+#define GPIO_OUT_W1TS_ADDRESS       0x04
+#define GPIO_OUT_W1TC_ADDRESS       0x08
+#define GPIO_ENABLE_W1TS_ADDRESS    0x10
+#define GPIO_ENABLE_W1TC_ADDRESS    0x14
+#define GPIO_IN_ADDRESS             0x18
+#define GPIO_STATUS_ADDRESS         0x1c
+#define GPIO_STATUS_W1TC_ADDRESS    0x24
+
+uint32_t hal_reg_read(uint32_t reg);
+void hal_reg_write(uint32_t reg, uint32_t val);
+
+#define GPIO_REG_READ(reg)          hal_reg_read(reg)
+#define GPIO_REG_WRITE(reg, val)    hal_reg_write(reg, val)
+#define GPIO_ID_PIN(n)              (n)
+#define GPIO_INPUT_GET(pin)         hal_pin_get(pin)
+#define GPIO_OUTPUT_SET(pin, level) ( hal_pin_set(pin, level), hal_pin_dir(pin, 1) )
+#define GPIO_DIS_OUTPUT(pin)        hal_pin_dir(pin, 0)
+#define PIN_FUNC_SELECT(reg, func)  do { } while (0)
+#define PIN_PULLUP_DIS(reg)         do { } while (0)
+#define PIN_PULLUP_EN(reg)          do { } while (0)
+
+/*
+ * GPIO interrupt, one handler for all pins as in SDK. Edges are looked for
+ * only while time passes in vTaskDelay()/os_delay_us() with interrupts not
+ * masked, every HAL_IRQ_CYCLES, handler runs with clock at the edge
+ */
+#define HAL_IRQ_CYCLES              20
+#define ETS_GPIO_INUM               4
+#define GPIO_PIN_INTR_DISABLE       0
+#define GPIO_PIN_INTR_POSEDGE       1
+#define GPIO_PIN_INTR_NEGEDGE       2
+#define GPIO_PIN_INTR_ANYEDGE       3
+
+void gpio_intr_handler_register(void *fn, void *arg);
+void gpio_pin_intr_state_set(uint32_t pin, int state);
+void _xt_isr_unmask(uint32_t mask);
+void _xt_isr_mask(uint32_t mask);
+
+#endif
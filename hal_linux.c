@@ -0,0 +1,682 @@
+/*
+ * Copyright (C) 2017, Denys Fedoryshchenko
+ * Contact: <nuclearcat@nuclearcat.com>
+ * Licensed under the GPLv2
+ * <http://www.gnu.org/licenses/old-licenses/gpl-2.0.txt>
+ *
+ * Linux backend of hal.h: virtual clock, GPIO pins with simulated devices,
+ * critical section accounting
+ */
+#include "hal.h"
+#include <pthread.h>
+
+#define HAL_PINS 17
+
+static uint64_t now;
+
+static struct {
+    uint8_t out;        /* output enabled */
+    uint8_t level;      /* output level */
+    uint8_t intr;       /* GPIO_PIN_INTR_* */
+    uint8_t seen;       /* level when interrupt last looked at pin */
+    sim_dev_t *devs;
+} pins[HAL_PINS];
+
+static int lock_depth;
+static uint32_t gpio_status;
+static void (*gpio_isr)(void *arg);
+static void *gpio_isr_arg;
+static uint32_t isr_unmasked;
+static uint64_t lock_start;
+static uint64_t stats_start;
+static hal_stats_t stats;
+
+uint64_t hal_time(void) {
+    return now;
+}
+
+void hal_advance(uint64_t cycles) {
+    now += cycles;
+}
+
+uint32_t hal_ccount(void) {
+    now++;
+    return (uint32_t)now;
+}
+
+/* Master pulls line low only with output enabled and level 0 */
+static int master_low(int pin) {
+    return pins[pin].out && !pins[pin].level;
+}
+
+static void master_update(int pin, int was_low) {
+    sim_dev_t *d;
+    int low = master_low(pin);
+
+    if (low == was_low)
+        return;
+    for (d = pins[pin].devs; d; d = d->next)
+        d->edge(d, !low, now);
+}
+
+/* Master drives pin high (strong pullup) */
+static int master_high(int pin) {
+    return pins[pin].out && pins[pin].level;
+}
+
+static void drive_update(int pin, int was_high) {
+    sim_dev_t *d;
+    int high = master_high(pin);
+
+    if (high == was_high)
+        return;
+    for (d = pins[pin].devs; d; d = d->next) {
+        if (d->drive)
+            d->drive(d, high, now);
+    }
+}
+
+static void pin_set(int pin, int level) {
+    int was_low = master_low(pin), was_high = master_high(pin);
+
+    pins[pin].level = level ? 1 : 0;
+    drive_update(pin, was_high);
+    master_update(pin, was_low);
+}
+
+static void pin_dir(int pin, int out) {
+    int was_low = master_low(pin), was_high = master_high(pin);
+
+    pins[pin].out = out ? 1 : 0;
+    drive_update(pin, was_high);
+    master_update(pin, was_low);
+}
+
+static int pin_get(int pin) {
+    sim_dev_t *d;
+
+    if (master_low(pin))
+        return 0;
+    for (d = pins[pin].devs; d; d = d->next) {
+        if (!d->level(d, now))
+            return 0;
+    }
+    /* Pullup */
+    return 1;
+}
+
+void hal_pin_set(int pin, int level) {
+    now += HAL_IO_CYCLES;
+    pin_set(pin, level);
+}
+
+void hal_pin_dir(int pin, int out) {
+    now += HAL_IO_CYCLES;
+    pin_dir(pin, out);
+}
+
+int hal_pin_get(int pin) {
+    now += HAL_IO_CYCLES;
+    return pin_get(pin);
+}
+
+void hal_mask_set(uint32_t mask, int level) {
+    int pin;
+
+    now += HAL_IO_CYCLES;
+    for (pin = 0; pin < HAL_PINS; pin++) {
+        if (mask & (1 << pin))
+            pin_set(pin, level);
+    }
+}
+
+void hal_mask_dir(uint32_t mask, int out) {
+    int pin;
+
+    now += HAL_IO_CYCLES;
+    for (pin = 0; pin < HAL_PINS; pin++) {
+        if (mask & (1 << pin))
+            pin_dir(pin, out);
+    }
+}
+
+uint32_t hal_in(void) {
+    uint32_t in = 0;
+    int pin;
+
+    now += HAL_IO_CYCLES;
+    for (pin = 0; pin < HAL_PINS; pin++)
+        in |= (uint32_t)pin_get(pin) << pin;
+    return in;
+}
+
+/* Old SDK GPIO registers, only the ones drivers use */
+uint32_t hal_reg_read(uint32_t reg) {
+    if (reg == GPIO_IN_ADDRESS)
+        return hal_in();
+    now += HAL_IO_CYCLES;
+    if (reg == GPIO_STATUS_ADDRESS)
+        return gpio_status;
+    return 0;
+}
+
+void hal_reg_write(uint32_t reg, uint32_t val) {
+    switch (reg) {
+    case GPIO_OUT_W1TS_ADDRESS:
+        hal_mask_set(val, 1);
+        break;
+    case GPIO_OUT_W1TC_ADDRESS:
+        hal_mask_set(val, 0);
+        break;
+    case GPIO_ENABLE_W1TS_ADDRESS:
+        hal_mask_dir(val, 1);
+        break;
+    case GPIO_ENABLE_W1TC_ADDRESS:
+        hal_mask_dir(val, 0);
+        break;
+    case GPIO_STATUS_W1TC_ADDRESS:
+        now += HAL_IO_CYCLES;
+        gpio_status &= ~val;
+        break;
+    default:
+        now += HAL_IO_CYCLES;
+    }
+}
+
+void hal_sim_attach(sim_dev_t *d, int pin) {
+    d->pin = pin;
+    d->next = pins[pin].devs;
+    pins[pin].devs = d;
+}
+
+/* Sensor unplugged, device is not freed */
+void hal_sim_detach(sim_dev_t *d) {
+    sim_dev_t **p;
+
+    for (p = &pins[d->pin].devs; *p; p = &(*p)->next) {
+        if (*p == d) {
+            *p = d->next;
+            break;
+        }
+    }
+}
+
+void hal_lock(void) {
+    if (!lock_depth++)
+        lock_start = now;
+}
+
+void hal_unlock(void) {
+    uint64_t masked;
+
+    if (!lock_depth || --lock_depth)
+        return;
+    masked = now - lock_start;
+    stats.masked += masked;
+    if (masked > stats.masked_max)
+        stats.masked_max = masked;
+    stats.locks++;
+}
+
+void hal_stats_reset(void) {
+    memset(&stats, 0, sizeof(stats));
+    stats_start = now;
+}
+
+void hal_stats_get(hal_stats_t *st) {
+    *st = stats;
+    st->cycles = now - stats_start;
+}
+
+void gpio_intr_handler_register(void *fn, void *arg) {
+    gpio_isr = (void (*)(void *))fn;
+    gpio_isr_arg = arg;
+}
+
+void gpio_pin_intr_state_set(uint32_t pin, int state) {
+    pins[pin].intr = state;
+    pins[pin].seen = pin_get(pin);
+}
+
+void _xt_isr_unmask(uint32_t mask) {
+    isr_unmasked |= mask;
+}
+
+void _xt_isr_mask(uint32_t mask) {
+    isr_unmasked &= ~mask;
+}
+
+/*
+ * Let time pass till until, looking for edges on pins with interrupt set.
+ * Handler is called while status has bits set, as on chip interrupt comes
+ * again if handler doesn't clear them
+ */
+static void irq_until(uint64_t until) {
+    uint32_t armed;
+    int pin, level;
+
+    for (;;) {
+        armed = 0;
+        for (pin = 0; pin < HAL_PINS; pin++) {
+            if (!pins[pin].intr)
+                continue;
+            armed = 1;
+            level = pin_get(pin);
+            if (level == pins[pin].seen)
+                continue;
+            pins[pin].seen = level;
+            if (pins[pin].intr == GPIO_PIN_INTR_ANYEDGE ||
+                pins[pin].intr == (level ? GPIO_PIN_INTR_POSEDGE : GPIO_PIN_INTR_NEGEDGE))
+                gpio_status |= 1 << pin;
+        }
+        if (gpio_status && gpio_isr && !lock_depth && (isr_unmasked & (1 << ETS_GPIO_INUM)))
+            gpio_isr(gpio_isr_arg);
+        if (!armed || now >= until)
+            break;
+        now += HAL_IRQ_CYCLES;
+    }
+    if (now < until)
+        now = until;
+}
+
+void vTaskDelay(TickType_t ticks) {
+    if (lock_depth)
+        fprintf(stderr, "hal: vTaskDelay with interrupts masked\n");
+    irq_until(now + HAL_US(1000) * portTICK_RATE_MS * ticks);
+}
+
+TickType_t xTaskGetTickCount(void) {
+    return (TickType_t)(now / (HAL_US(1000) * portTICK_RATE_MS));
+}
+
+void os_delay_us(uint32_t us) {
+    irq_until(now + HAL_US(us));
+}
+
+uint8_t system_get_cpu_freq(void) {
+    return HAL_CPU_MHZ;
+}
+
+/* No reset here, caller just continues as if it woke up */
+void esp_deep_sleep(uint64_t us) {
+    now += HAL_US(us);
+}
+
+/*
+ * Tasks: running one holds cpu mutex and gives it up only waiting on queue.
+ * Main thread takes it when first task is created.
+ */
+static pthread_mutex_t cpu = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cpu_wake = PTHREAD_COND_INITIALIZER;
+static int cpu_taken;
+
+typedef struct {
+    uint32_t len;
+    uint32_t size;
+    uint32_t head;
+    uint32_t count;
+    uint8_t item[];
+} queue_t;
+
+typedef struct {
+    void (*fn)(void *);
+    void *arg;
+} task_start_t;
+
+xQueueHandle xQueueCreate(uint32_t len, uint32_t item_size) {
+    queue_t *q = calloc(1, sizeof(*q) + len * item_size);
+
+    if (q) {
+        q->len = len;
+        q->size = item_size;
+    }
+    return q;
+}
+
+void vQueueDelete(xQueueHandle q) {
+    free(q);
+}
+
+/* Let other tasks run till queue has room (or item), 0 if it won't */
+static int queue_wait(queue_t *q, int room, TickType_t ticks) {
+    while (room ? q->count == q->len : !q->count) {
+        if (ticks != portMAX_DELAY || !cpu_taken)
+            return 0;
+        pthread_cond_wait(&cpu_wake, &cpu);
+    }
+    return 1;
+}
+
+int xQueueSend(xQueueHandle h, const void *item, TickType_t ticks) {
+    queue_t *q = h;
+
+    if (!queue_wait(q, 1, ticks))
+        return pdFALSE;
+    memcpy(q->item + (q->head + q->count) % q->len * q->size, item, q->size);
+    q->count++;
+    pthread_cond_broadcast(&cpu_wake);
+    return pdTRUE;
+}
+
+int xQueueReceive(xQueueHandle h, void *item, TickType_t ticks) {
+    queue_t *q = h;
+
+    if (!queue_wait(q, 0, ticks))
+        return pdFALSE;
+    memcpy(item, q->item + q->head * q->size, q->size);
+    q->head = (q->head + 1) % q->len;
+    q->count--;
+    pthread_cond_broadcast(&cpu_wake);
+    return pdTRUE;
+}
+
+static void *task_main(void *arg) {
+    task_start_t t = *(task_start_t *)arg;
+
+    free(arg);
+    pthread_mutex_lock(&cpu);
+    t.fn(t.arg);
+    vTaskDelete(NULL);
+    return NULL;
+}
+
+int xTaskCreate(void (*fn)(void *), const signed char *name, uint16_t stack, void *arg, uint32_t prio, xTaskHandle *h) {
+    task_start_t *t = malloc(sizeof(*t));
+    pthread_attr_t attr;
+    pthread_t th;
+    int r;
+
+    if (!t)
+        return pdFALSE;
+    t->fn = fn;
+    t->arg = arg;
+    if (!cpu_taken) {
+        pthread_mutex_lock(&cpu);
+        cpu_taken = 1;
+    }
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    r = pthread_create(&th, &attr, task_main, t);
+    pthread_attr_destroy(&attr);
+    if (r) {
+        free(t);
+        return pdFALSE;
+    }
+    return pdPASS;
+}
+
+/* Only task deleting itself */
+void vTaskDelete(xTaskHandle h) {
+    pthread_cond_broadcast(&cpu_wake);
+    pthread_mutex_unlock(&cpu);
+    pthread_exit(NULL);
+}
+
+int gpio_config(const gpio_config_t *conf) {
+    int pin;
+
+    for (pin = 0; pin < HAL_PINS; pin++) {
+        if (conf->pin_bit_mask & (1ULL << pin))
+            hal_pin_dir(pin, conf->mode == GPIO_MODE_OUTPUT);
+    }
+    return 0;
+}
+
+int gpio_set_direction(gpio_num_t pin, gpio_mode_t mode) {
+    hal_pin_dir(pin, mode == GPIO_MODE_OUTPUT);
+    return 0;
+}
+
+int gpio_set_level(gpio_num_t pin, uint32_t level) {
+    hal_pin_set(pin, level);
+    return 0;
+}
+
+/*
+ * UART loopback model: TX drives pin low for 0 bits and releases it for 1 bits
+ * (open drain), RX samples pin in middle of each bit, so echo carries what
+ * devices did on the bus. Writes take virtual time of all bits.
+ */
+#define UART_RX     256
+
+static struct {
+    int pin;            /* -1 not attached, no echo */
+    uint32_t baud;
+    uint8_t rx[UART_RX];
+    int head, tail;
+} uart[2] = { { .pin = -1, .baud = 115200 }, { .pin = -1, .baud = 115200 } };
+
+void hal_uart_attach(int port, int pin) {
+    uart[port].pin = pin;
+    pins[pin].level = 0;
+}
+
+int uart_param_config(uart_port_t port, const uart_config_t *conf) {
+    uart[port].baud = conf->baud_rate;
+    return ESP_OK;
+}
+
+int uart_driver_install(uart_port_t port, int rx_size, int tx_size, int queue_size, void *queue, int no_use) {
+    return ESP_OK;
+}
+
+int uart_set_baudrate(uart_port_t port, uint32_t baud) {
+    uart[port].baud = baud;
+    return ESP_OK;
+}
+
+static uint8_t uart_byte(int pin, uint32_t baud, uint8_t c) {
+    uint64_t start = now, bit = (uint64_t)HAL_CPU_MHZ * 1000000;
+    uint8_t rx = 0;
+    int i, level;
+
+    /* start bit, 8 data bits LSB first, stop bit */
+    for (i = 0; i < 10; i++) {
+        level = i == 0 ? 0 : i == 9 ? 1 : (c >> (i - 1)) & 1;
+        now = start + bit * i / baud;
+        pin_dir(pin, !level);
+        now = start + bit * (2 * i + 1) / (2 * baud);
+        if (i > 0 && i < 9)
+            rx |= pin_get(pin) << (i - 1);
+    }
+    now = start + bit * 10 / baud;
+    return rx;
+}
+
+int uart_write_bytes(uart_port_t port, const char *src, size_t size) {
+    size_t i;
+    uint8_t rx;
+
+    for (i = 0; i < size; i++) {
+        if (uart[port].pin < 0) {
+            now += (uint64_t)HAL_CPU_MHZ * 1000000 * 10 / uart[port].baud;
+            continue;
+        }
+        rx = uart_byte(uart[port].pin, uart[port].baud, src[i]);
+        if ((uart[port].head + 1) % UART_RX != uart[port].tail) {
+            uart[port].rx[uart[port].head] = rx;
+            uart[port].head = (uart[port].head + 1) % UART_RX;
+        }
+    }
+    return size;
+}
+
+/* Echo is already there after write, timeout only passes if bytes are missing */
+int uart_read_bytes(uart_port_t port, uint8_t *buf, uint32_t length, TickType_t ticks) {
+    uint32_t n = 0;
+
+    while (n < length && uart[port].tail != uart[port].head) {
+        buf[n++] = uart[port].rx[uart[port].tail];
+        uart[port].tail = (uart[port].tail + 1) % UART_RX;
+    }
+    if (n < length)
+        vTaskDelay(ticks);
+    return n;
+}
+
+int uart_flush_input(uart_port_t port) {
+    uart[port].tail = uart[port].head;
+    return ESP_OK;
+}
+
+int uart_enable_swap(void) {
+    return ESP_OK;
+}
+
+/*
+ * SPI flash in a file. Like real flash, write can only clear bits, erase
+ * sets whole sector to 0xFF. Erase and write take virtual time.
+ */
+static FILE *flash;
+static uint32_t flash_size;
+
+int hal_flash_open(const char *path, uint32_t size) {
+    uint8_t ff[SPI_FLASH_SEC_SIZE];
+    uint32_t i;
+
+    if (flash)
+        fclose(flash);
+    flash_size = size;
+    flash = fopen(path, "r+b");
+    if (flash)
+        return 0;
+    flash = fopen(path, "w+b");
+    if (!flash)
+        return -1;
+    memset(ff, 0xFF, sizeof(ff));
+    for (i = 0; i < size; i += sizeof(ff))
+        fwrite(ff, 1, sizeof(ff), flash);
+    return 0;
+}
+
+SpiFlashOpResult spi_flash_erase_sector(uint16_t sec) {
+    uint8_t ff[SPI_FLASH_SEC_SIZE];
+
+    if (!flash || (uint32_t)(sec + 1) * SPI_FLASH_SEC_SIZE > flash_size)
+        return SPI_FLASH_RESULT_ERR;
+    memset(ff, 0xFF, sizeof(ff));
+    fseek(flash, (long)sec * SPI_FLASH_SEC_SIZE, SEEK_SET);
+    fwrite(ff, 1, sizeof(ff), flash);
+    fflush(flash);
+    now += HAL_US(30000);
+    return SPI_FLASH_RESULT_OK;
+}
+
+SpiFlashOpResult spi_flash_write(uint32_t addr, uint32_t *src, uint32_t size) {
+    uint8_t old[256];
+    const uint8_t *p = (const uint8_t *)src;
+    uint32_t n, i;
+
+    if (!flash || (addr & 3) || (size & 3) || addr + size > flash_size)
+        return SPI_FLASH_RESULT_ERR;
+    while (size) {
+        n = size > sizeof(old) ? sizeof(old) : size;
+        fseek(flash, addr, SEEK_SET);
+        if (fread(old, 1, n, flash) != n)
+            return SPI_FLASH_RESULT_ERR;
+        for (i = 0; i < n; i++)
+            old[i] &= p[i];
+        fseek(flash, addr, SEEK_SET);
+        fwrite(old, 1, n, flash);
+        now += HAL_US(600);
+        addr += n;
+        p += n;
+        size -= n;
+    }
+    fflush(flash);
+    return SPI_FLASH_RESULT_OK;
+}
+
+SpiFlashOpResult spi_flash_read(uint32_t addr, uint32_t *dst, uint32_t size) {
+    if (!flash || addr + size > flash_size)
+        return SPI_FLASH_RESULT_ERR;
+    fseek(flash, addr, SEEK_SET);
+    if (fread(dst, 1, size, flash) != size)
+        return SPI_FLASH_RESULT_ERR;
+    return SPI_FLASH_RESULT_OK;
+}
+
+/*
+ * Same layout as SDK: start_sec and start_sec + 1 hold data, flag in
+ * start_sec + 2 tells which one, new data goes to other one before flag is
+ * switched, so power loss in between leaves old copy.
+ */
+static uint32_t param_flag(uint16_t start_sec) {
+    uint32_t flag;
+
+    if (spi_flash_read((start_sec + 2) * SPI_FLASH_SEC_SIZE, &flag, 4) != SPI_FLASH_RESULT_OK)
+        return 0;
+    return flag == 1;
+}
+
+bool system_param_save_with_protect(uint16_t start_sec, void *param, uint16_t len) {
+    uint32_t flag = !param_flag(start_sec);
+    uint16_t sec = start_sec + flag;
+
+    if ((len & 3) || len > SPI_FLASH_SEC_SIZE)
+        return false;
+    if (spi_flash_erase_sector(sec) != SPI_FLASH_RESULT_OK ||
+        spi_flash_write(sec * SPI_FLASH_SEC_SIZE, param, len) != SPI_FLASH_RESULT_OK ||
+        spi_flash_erase_sector(start_sec + 2) != SPI_FLASH_RESULT_OK ||
+        spi_flash_write((start_sec + 2) * SPI_FLASH_SEC_SIZE, &flag, 4) != SPI_FLASH_RESULT_OK)
+        return false;
+    return true;
+}
+
+bool system_param_load(uint16_t start_sec, uint16_t offset, void *param, uint16_t len) {
+    uint16_t sec = start_sec + param_flag(start_sec);
+
+    if (offset + len > SPI_FLASH_SEC_SIZE)
+        return false;
+    return spi_flash_read(sec * SPI_FLASH_SEC_SIZE + offset, param, len) == SPI_FLASH_RESULT_OK;
+}
+
+/*
+ * RTC memory, 768 bytes, first 256 belong to system. With file it survives
+ * between runs as it survives deep sleep, without one it starts as garbage.
+ */
+#define RTC_SIZE    768
+#define RTC_USER    64
+
+static uint8_t rtc_mem[RTC_SIZE];
+static FILE *rtc;
+
+int hal_rtc_open(const char *path) {
+    int i;
+
+    if (rtc)
+        fclose(rtc);
+    rtc = fopen(path, "r+b");
+    if (rtc) {
+        if (fread(rtc_mem, 1, RTC_SIZE, rtc) != RTC_SIZE)
+            return -1;
+        return 0;
+    }
+    rtc = fopen(path, "w+b");
+    if (!rtc)
+        return -1;
+    for (i = 0; i < RTC_SIZE; i++)
+        rtc_mem[i] = rand();
+    fwrite(rtc_mem, 1, RTC_SIZE, rtc);
+    fflush(rtc);
+    return 0;
+}
+
+bool system_rtc_mem_write(uint8_t des_addr, const void *src_addr, uint16_t save_size) {
+    if (des_addr < RTC_USER || des_addr * 4 + save_size > RTC_SIZE)
+        return false;
+    memcpy(&rtc_mem[des_addr * 4], src_addr, save_size);
+    if (rtc) {
+        fseek(rtc, des_addr * 4, SEEK_SET);
+        fwrite(src_addr, 1, save_size, rtc);
+        fflush(rtc);
+    }
+    return true;
+}
+
+bool system_rtc_mem_read(uint8_t src_addr, void *des_addr, uint16_t load_size) {
+    if (src_addr < RTC_USER || src_addr * 4 + load_size > RTC_SIZE)
+        return false;
+    memcpy(des_addr, &rtc_mem[src_addr * 4], load_size);
+    return true;
+}
@@ -16,7 +16,12 @@
  * WARNING! I dont do supplied params check, so callback must be not NULL, size > 0, etc
  * Still experimental.
  */
+#ifdef HAL_LINUX
+#include "hal.h"
+#else
 #include "esp_common.h"
+#endif
+#include "esp8266stuff.h"
 
 /* Upgrade process state */
 #define STATUSLINE 0
@@ -60,3 +65,597 @@ void parse_http(uint8_t *state, char *buf, int *size, void *callback) {
                 }
         }
 }
+
+/*
+ * Incremental HTTP/1.x response parser, for keep-alive connections.
+ * Feed it whatever recv() returned, it keeps state between calls, body is
+ * passed to callback directly from receive buffer (no copy), in spans of
+ * arbitrary size, chunked encoding removed.
+ * http_parse() returns number of bytes consumed, it stops at end of response,
+ * so rest of buffer belongs to next response (pipelining), -1 on error.
+ *
+ * http_parser_init(&p, &bodycb, ctx);
+ * do {
+ *  ret = recv(s, recv_buf, BUF_SZ, 0);
+ *  if (ret > 0 && http_parse(&p, recv_buf, ret) < 0)
+ *       break;
+ * } while (ret > 0 && p.state != HP_DONE);
+ * if (p.state == HP_DONE && http_keepalive(&p)) ... connection can be reused
+ *
+ * Headers are not kept, but http_parser_headers() sets callback which gets
+ * them as spans of receive buffer: HTTP_HDR_NAME, HTTP_HDR_VALUE (without
+ * leading whitespace and CRLF), then HTTP_HDR_END with len 0. If header line
+ * is split between two recv() buffers, name or value comes in two fragments,
+ * callback has to join them if it needs to.
+ */
+/* Header line being parsed, by bit in hdr */
+#define HDR_LENGTH      0
+#define HDR_ENCODING    1
+#define HDR_CONNECTION  2
+#define HDR_ETAG        3
+#define HDR_MODIFIED    4
+#define HDR_COUNT       5
+
+static const char *hdr_names[HDR_COUNT] = {
+        "content-length", "transfer-encoding", "connection", "etag", "last-modified"
+};
+
+static inline char lower(char c) {
+        return (c >= 'A' && c <= 'Z') ? c + 32 : c;
+}
+
+static int hexval(char c) {
+        if (c >= '0' && c <= '9')
+                return c - '0';
+        c = lower(c);
+        if (c >= 'a' && c <= 'f')
+                return c - 'a' + 10;
+        return -1;
+}
+
+/* Match token in header value incrementally, return 1 when whole token seen */
+static int token_match(uint8_t *pos, char c, const char *token) {
+        c = lower(c);
+        if (token[*pos] == c) {
+                if (!token[++(*pos)])
+                        return 1;
+                return 0;
+        }
+        *pos = (token[0] == c) ? 1 : 0;
+        return 0;
+}
+
+void http_parser_init(http_parser_t *p, void (*body)(void *, char *, int), void *ctx) {
+        memset(p, 0, sizeof(*p));
+        p->state = HP_STATUS;
+        p->body = body;
+        p->ctx = ctx;
+}
+
+void http_parser_headers(http_parser_t *p, void (*header)(void *, int, char *, int)) {
+        p->header = header;
+}
+
+/* Collect ETag and Last-Modified of response into v */
+void http_parser_validators(http_parser_t *p, http_validator_t *v) {
+        memset(v, 0, sizeof(*v));
+        p->valid = v;
+}
+
+static void header_span(http_parser_t *p, int part, char *buf, int from, int to) {
+        if (p->header && from >= 0 && (to > from || part == HTTP_HDR_END))
+                p->header(p->ctx, part, &buf[from], to - from);
+}
+
+/* Copy header value to dst, one that doesn't fit is dropped, not truncated */
+static void value_copy(http_parser_t *p, char *dst, int size, char c) {
+        if (p->pos == 255 || (!p->pos && (c == ' ' || c == '\t')))
+                return;
+        if (p->pos >= size - 1) {
+                dst[0] = 0;
+                p->pos = 255;
+                return;
+        }
+        dst[p->pos++] = c;
+        dst[p->pos] = 0;
+}
+
+/* All headers received, decide how body is framed */
+static void headers_done(http_parser_t *p) {
+        if (!(p->flags & HTTP_11) && !(p->flags & HTTP_KEEPALIVE))
+                p->flags |= HTTP_CLOSE;
+
+        if (p->status >= 100 && p->status < 200) {
+                /* Informational, real response follows */
+                p->state = HP_STATUS;
+                p->status = 0;
+                p->pos = 0;
+        } else if ((p->flags & HTTP_NOBODY) || p->status == 204 || p->status == 304) {
+                p->state = HP_DONE;
+        } else if (p->flags & HTTP_CHUNKED) {
+                p->state = HP_CHUNK_SIZE;
+                p->length = 0;
+        } else if (p->flags & HTTP_LENGTH) {
+                p->state = p->length ? HP_BODY : HP_DONE;
+        } else {
+                /* Body till connection close */
+                p->flags |= HTTP_CLOSE;
+                p->state = HP_BODY_CLOSE;
+        }
+}
+
+static void header_char(http_parser_t *p, char c) {
+        int i;
+
+        if (p->state == HP_NAME) {
+                if (c == ':') {
+                        p->hdr = HDR_COUNT;
+                        for (i = 0; i < HDR_COUNT; i++) {
+                                if ((p->cand & (1 << i)) && !hdr_names[i][p->pos])
+                                        p->hdr = i;
+                        }
+                        p->state = HP_VALUE;
+                        p->pos = 0;
+                        p->pos2 = 0;
+                        p->lead = 1;
+                        /* Each Content-Length counts from 0, repeated one must be same */
+                        if (p->hdr == HDR_LENGTH) {
+                                p->pos2 = (p->flags & HTTP_LENGTH) ? 1 : 0;
+                                p->length1 = p->length;
+                                p->length = 0;
+                        }
+                        return;
+                }
+                for (i = 0; i < HDR_COUNT; i++) {
+                        if ((p->cand & (1 << i)) && hdr_names[i][p->pos] != lower(c))
+                                p->cand &= ~(1 << i);
+                }
+                if (p->pos < 255)
+                        p->pos++;
+                return;
+        }
+
+        /* HP_VALUE */
+        switch (p->hdr) {
+        case HDR_LENGTH:
+                if (c >= '0' && c <= '9') {
+                        if (p->length > (0xFFFFFFFF - (c - '0')) / 10) {
+                                p->state = HP_ERROR;
+                                break;
+                        }
+                        p->length = p->length * 10 + (c - '0');
+                        p->flags |= HTTP_LENGTH;
+                }
+                break;
+        case HDR_ENCODING:
+                if (token_match(&p->pos, c, "chunked"))
+                        p->flags |= HTTP_CHUNKED;
+                break;
+        case HDR_CONNECTION:
+                if (token_match(&p->pos, c, "close"))
+                        p->flags |= HTTP_CLOSE;
+                if (token_match(&p->pos2, c, "keep-alive"))
+                        p->flags |= HTTP_KEEPALIVE;
+                break;
+        case HDR_ETAG:
+                if (p->valid)
+                        value_copy(p, p->valid->etag, HTTP_ETAG_LEN, c);
+                break;
+        case HDR_MODIFIED:
+                if (p->valid)
+                        value_copy(p, p->valid->modified, HTTP_DATE_LEN, c);
+                break;
+        }
+}
+
+/*
+ * Returns number of bytes consumed (stops at end of response), -1 on error.
+ * Call with buf NULL when connection is closed: body without length ends
+ * there (HP_DONE), any other unfinished response is truncated (-1).
+ */
+int http_parse(http_parser_t *p, char *buf, int size) {
+        int i = 0, n, v;
+        int span = -1;  /* start of header name/value fragment in buf */
+        char c;
+
+        if (!buf) {
+                if (p->state == HP_BODY_CLOSE)
+                        p->state = HP_DONE;
+                else if (p->state != HP_DONE)
+                        p->state = HP_ERROR;
+                return (p->state == HP_ERROR) ? -1 : 0;
+        }
+
+        /* Header split by previous buffer continues from start of this one */
+        if (p->state == HP_NAME || (p->state == HP_VALUE && !p->lead))
+                span = 0;
+
+        while (i < size) {
+                switch (p->state) {
+                case HP_BODY:
+                case HP_CHUNK_DATA:
+                        /* Pass as much as we have in one span */
+                        n = size - i;
+                        if ((uint32_t)n > p->length)
+                                n = p->length;
+                        if (p->body)
+                                p->body(p->ctx, &buf[i], n);
+                        i += n;
+                        p->length -= n;
+                        if (!p->length)
+                                p->state = (p->state == HP_BODY) ? HP_DONE : HP_CHUNK_CRLF;
+                        break;
+                case HP_BODY_CLOSE:
+                        if (p->body)
+                                p->body(p->ctx, &buf[i], size - i);
+                        return size;
+                case HP_DONE:
+                        return i;
+                case HP_ERROR:
+                        return -1;
+                default:
+                        c = buf[i++];
+                        switch (p->state) {
+                        case HP_STATUS:
+                                /* HTTP/1.x SSS Reason */
+                                if (c == '\n') {
+                                        p->state = (p->status >= 100) ? HP_HEADER : HP_ERROR;
+                                } else if (p->pos < 5) {
+                                        if (c != "HTTP/"[p->pos++])
+                                                p->state = HP_ERROR;
+                                } else if (p->pos < 8) {
+                                        /* 1.x */
+                                        if (p->pos++ == 7 && c != '0')
+                                                p->flags |= HTTP_11;
+                                } else if (p->pos < 12) {
+                                        /* space and 3 digits */
+                                        if (p->pos++ < 9)
+                                                break;
+                                        if (c < '0' || c > '9')
+                                                p->state = HP_ERROR;
+                                        p->status = p->status * 10 + (c - '0');
+                                }
+                                break;
+                        case HP_HEADER:
+                                if (c == '\r')
+                                        break;
+                                if (c == '\n') {
+                                        headers_done(p);
+                                        break;
+                                }
+                                p->state = HP_NAME;
+                                p->cand = (1 << HDR_COUNT) - 1;
+                                p->pos = 0;
+                                span = i - 1;
+                                header_char(p, c);
+                                break;
+                        case HP_NAME:
+                        case HP_VALUE:
+                                if (c == '\r' || c == '\n') {
+                                        if (p->state == HP_VALUE)
+                                                header_span(p, HTTP_HDR_VALUE, buf, span, i - 1);
+                                        span = -1;
+                                        if (c == '\n') {
+                                                header_span(p, HTTP_HDR_END, buf, i, i);
+                                                if (p->state == HP_VALUE && p->hdr == HDR_LENGTH &&
+                                                    p->pos2 && p->length != p->length1)
+                                                        p->state = HP_ERROR;
+                                                else
+                                                        p->state = HP_HEADER;
+                                        }
+                                        break;
+                                }
+                                if (p->state == HP_NAME && c == ':') {
+                                        header_span(p, HTTP_HDR_NAME, buf, span, i - 1);
+                                        span = -1;
+                                } else if (p->state == HP_VALUE && span < 0 &&
+                                           (!p->lead || (c != ' ' && c != '\t'))) {
+                                        span = i - 1;
+                                        p->lead = 0;
+                                }
+                                header_char(p, c);
+                                break;
+                        case HP_CHUNK_SIZE:
+                                v = hexval(c);
+                                if (v >= 0) {
+                                        if (p->length >> 28)
+                                                p->state = HP_ERROR;
+                                        p->length = (p->length << 4) | v;
+                                } else if (c == ';' || c == ' ') {
+                                        p->state = HP_CHUNK_EXT;
+                                } else if (c == '\n') {
+                                        p->state = p->length ? HP_CHUNK_DATA : HP_TRAILER;
+                                        p->pos = 0;
+                                } else if (c != '\r') {
+                                        p->state = HP_ERROR;
+                                }
+                                break;
+                        case HP_CHUNK_EXT:
+                                if (c == '\n') {
+                                        p->state = p->length ? HP_CHUNK_DATA : HP_TRAILER;
+                                        p->pos = 0;
+                                }
+                                break;
+                        case HP_CHUNK_CRLF:
+                                if (c == '\n') {
+                                        p->state = HP_CHUNK_SIZE;
+                                        p->length = 0;
+                                }
+                                break;
+                        case HP_TRAILER:
+                                /* Skip trailer headers till empty line */
+                                if (c == '\n') {
+                                        if (!p->pos)
+                                                p->state = HP_DONE;
+                                        p->pos = 0;
+                                } else if (c != '\r') {
+                                        p->pos = 1;
+                                }
+                                break;
+                        }
+                }
+        }
+        /* Header continues in next buffer */
+        if (p->state == HP_NAME)
+                header_span(p, HTTP_HDR_NAME, buf, span, i);
+        else if (p->state == HP_VALUE)
+                header_span(p, HTTP_HDR_VALUE, buf, span, i);
+        return (p->state == HP_ERROR) ? -1 : i;
+}
+
+/* Response complete and server didn't ask to close connection */
+int http_keepalive(http_parser_t *p) {
+        return p->state == HP_DONE && !(p->flags & HTTP_CLOSE);
+}
+
+/*
+ * Request builder, writes into caller buffer, no allocations.
+ * HTTP/1.1, so connection stays open, several requests can be written one
+ * after another without waiting for responses (pipelining), see http_pipe_*
+ *
+ * http_req_begin(&r, buf, sizeof(buf), "POST", "example.com", "/sensor");
+ * http_req_header(&r, "Content-Type", "application/json");
+ * len = http_req_end(&r, body, bodylen);
+ * if (len > 0) send(s, buf, len, 0);
+ */
+static void req_put(http_req_t *r, const char *s, int n) {
+        if (r->len + n > r->size) {
+                r->overflow = 1;
+                return;
+        }
+        memcpy(&r->buf[r->len], s, n);
+        r->len += n;
+}
+
+static void req_puts(http_req_t *r, const char *s) {
+        req_put(r, s, strlen(s));
+}
+
+static void req_putu(http_req_t *r, uint32_t v) {
+        char tmp[10];
+        int i = sizeof(tmp);
+
+        do {
+                tmp[--i] = '0' + v % 10;
+                v /= 10;
+        } while (v);
+        req_put(r, &tmp[i], sizeof(tmp) - i);
+}
+
+void http_req_begin(http_req_t *r, char *buf, int size, const char *method, const char *host, const char *path) {
+        r->buf = buf;
+        r->size = size;
+        r->len = 0;
+        r->overflow = 0;
+        req_puts(r, method);
+        req_put(r, " ", 1);
+        req_puts(r, path);
+        req_puts(r, " HTTP/1.1\r\nHost: ");
+        req_puts(r, host);
+        req_put(r, "\r\n", 2);
+}
+
+void http_req_header(http_req_t *r, const char *name, const char *value) {
+        req_puts(r, name);
+        req_put(r, ": ", 2);
+        req_puts(r, value);
+        req_put(r, "\r\n", 2);
+}
+
+/* Finish headers and add body (may be NULL), returns request length or -1 */
+int http_req_end(http_req_t *r, const char *body, int len) {
+        if (body) {
+                req_puts(r, "Content-Length: ");
+                req_putu(r, len);
+                req_put(r, "\r\n", 2);
+        }
+        req_put(r, "\r\n", 2);
+        if (body)
+                req_put(r, body, len);
+        return r->overflow ? -1 : r->len;
+}
+
+/*
+ * Responses to pipelined requests, in order they were sent.
+ * Call http_pipe_sent() for each request written to socket (flags
+ * HTTP_NOBODY for HEAD, its response has no body whatever headers say, else
+ * 0), at most 32 can wait for response. Then feed
+ * everything received to http_pipe_feed(), complete callback is called for
+ * each response with its status, so caller can drop acknowledged readings.
+ * If server closes connection (keepalive 0), requests still pending must be
+ * sent again on new connection, http_pipe_eof() tells how many.
+ * Validators (http_parser_validators()) hold those of response being
+ * completed only inside complete callback.
+ */
+void http_pipe_init(http_pipe_t *pp, void (*body)(void *, char *, int),
+                    void (*complete)(void *, int, int), void *ctx) {
+        http_parser_init(&pp->parser, body, ctx);
+        pp->pending = 0;
+        pp->nobody = 0;
+        pp->complete = complete;
+        pp->ctx = ctx;
+}
+
+void http_pipe_sent(http_pipe_t *pp, int flags) {
+        if (flags & HTTP_NOBODY) {
+                pp->nobody |= 1u << pp->pending;
+                /* Response being parsed is this one */
+                if (!pp->pending)
+                        pp->parser.flags |= HTTP_NOBODY;
+        }
+        pp->pending++;
+}
+
+/* Returns number of requests still waiting for response, -1 on error */
+int http_pipe_feed(http_pipe_t *pp, char *buf, int size) {
+        void (*header)(void *, int, char *, int) = pp->parser.header;
+        http_validator_t *valid = pp->parser.valid;
+        int n, keepalive;
+
+        while (size > 0 && pp->pending) {
+                n = http_parse(&pp->parser, buf, size);
+                if (n < 0)
+                        return -1;
+                buf += n;
+                size -= n;
+                if (pp->parser.state != HP_DONE)
+                        break;
+
+                keepalive = http_keepalive(&pp->parser);
+                pp->pending--;
+                if (pp->complete)
+                        pp->complete(pp->ctx, pp->parser.status, keepalive);
+                http_parser_init(&pp->parser, pp->parser.body, pp->ctx);
+                http_parser_headers(&pp->parser, header);
+                pp->nobody >>= 1;
+                if (pp->nobody & 1)
+                        pp->parser.flags |= HTTP_NOBODY;
+                /* Each response brings its own validators */
+                if (valid)
+                        http_parser_validators(&pp->parser, valid);
+                if (!keepalive)
+                        break;
+        }
+        return pp->pending;
+}
+
+/*
+ * Connection closed: completes response with body till close. Returns number
+ * of requests left without response (send them again), pipe is reset for new
+ * connection.
+ */
+int http_pipe_eof(http_pipe_t *pp) {
+        void (*header)(void *, int, char *, int) = pp->parser.header;
+        http_validator_t *valid = pp->parser.valid;
+        int left;
+
+        if (pp->pending && http_parse(&pp->parser, NULL, 0) == 0) {
+                pp->pending--;
+                if (pp->complete)
+                        pp->complete(pp->ctx, pp->parser.status, 0);
+        }
+        left = pp->pending;
+        http_pipe_init(pp, pp->parser.body, pp->complete, pp->ctx);
+        http_parser_headers(&pp->parser, header);
+        if (valid)
+                http_parser_validators(&pp->parser, valid);
+        return left;
+}
+
+/*
+ * Validator cache for conditional GET: ETag and Last-Modified of last 200
+ * response per URL, kept in flash by system_param_*, so after reboot polls of
+ * unchanged config/manifest still end with 304 and no body.
+ *
+ * http_cache_load(&cache, CACHE_SEC);
+ * v = http_cache_get(&cache, host, path);
+ * http_req_begin(&r, buf, sizeof(buf), "GET", host, path);
+ * http_req_conditional(&r, v);
+ * len = http_req_end(&r, NULL, 0);
+ * http_parser_init(&p, &bodycb, ctx);
+ * http_parser_validators(&p, &fresh);
+ * ... send, recv() and http_parse() until HP_DONE ...
+ * if (http_cache_update(&cache, v, &fresh, p.status)) ... not modified
+ * http_cache_save(&cache);
+ *
+ * Body of 200 should be applied before http_cache_update(), so if it fails,
+ * old validators are still there and next poll downloads it again.
+ */
+#define HTTP_CACHE_MAGIC        0x48544301
+
+/* FNV-1a of host and path, 0 is free entry */
+static uint32_t url_hash(const char *host, const char *path) {
+        uint32_t h = 2166136261u;
+
+        while (*host)
+                h = (h ^ (uint8_t)*host++) * 16777619u;
+        h = (h ^ '/') * 16777619u;
+        while (*path)
+                h = (h ^ (uint8_t)*path++) * 16777619u;
+        return h ? h : 1;
+}
+
+/* Returns 0 if cache was read from flash, -1 if it starts empty */
+int http_cache_load(http_cache_t *c, uint16_t sec) {
+        if (system_param_load(sec, 0, c, sizeof(*c)) && c->magic == HTTP_CACHE_MAGIC) {
+                c->sec = sec;
+                c->dirty = 0;
+                return 0;
+        }
+        memset(c, 0, sizeof(*c));
+        c->magic = HTTP_CACHE_MAGIC;
+        c->sec = sec;
+        return -1;
+}
+
+/* Validators of URL, new (empty) entry replaces least recently used one */
+http_validator_t *http_cache_get(http_cache_t *c, const char *host, const char *path) {
+        uint32_t url = url_hash(host, path);
+        http_cache_entry_t *e = &c->e[0];
+        int i;
+
+        for (i = 0; i < HTTP_CACHE_URLS; i++) {
+                if (c->e[i].url == url) {
+                        e = &c->e[i];
+                        break;
+                }
+                if (c->e[i].used < e->used)
+                        e = &c->e[i];
+        }
+        if (e->url != url) {
+                memset(e, 0, sizeof(*e));
+                e->url = url;
+                c->dirty = 1;
+        }
+        /* Not worth flash write by itself, saved with next change */
+        e->used = ++c->used;
+        return &e->v;
+}
+
+void http_req_conditional(http_req_t *r, const http_validator_t *v) {
+        if (v->etag[0])
+                http_req_header(r, "If-None-Match", v->etag);
+        if (v->modified[0])
+                http_req_header(r, "If-Modified-Since", v->modified);
+}
+
+/* Returns 1 on 304 (cached copy is current), new validators are taken on 200 */
+int http_cache_update(http_cache_t *c, http_validator_t *v, const http_validator_t *fresh, int status) {
+        if (status == 304)
+                return 1;
+        if (status == 200 && memcmp(v, fresh, sizeof(*v))) {
+                memcpy(v, fresh, sizeof(*v));
+                c->dirty = 1;
+        }
+        return 0;
+}
+
+/* Writes to flash only if something changed, returns 0 on success */
+int http_cache_save(http_cache_t *c) {
+        if (!c->dirty)
+                return 0;
+        if (!system_param_save_with_protect(c->sec, c, sizeof(*c)))
+                return -1;
+        c->dirty = 0;
+        return 0;
+}
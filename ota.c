@@ -0,0 +1,176 @@
+/*
+ * Copyright (C) 2017, Denys Fedoryshchenko
+ * Contact: <nuclearcat@nuclearcat.com>
+ * Licensed under the GPLv2
+ * <http://www.gnu.org/licenses/old-licenses/gpl-2.0.txt>
+ *
+ * Firmware image sink for HTTP body callback. Data of any chunk size is
+ * collected into two sector sized buffers, while one is erased&written to
+ * flash by writer task, other one is filled from network. CRC32 of image is
+ * calculated on the fly.
+ *
+ * ota_sink_t sink;
+ * ota_sink_begin(&sink, 0x101000);
+ * http_parser_init(&p, &ota_sink_write, &sink);
+ * ... recv() and http_parse() until HP_DONE ...
+ * if (!ota_sink_finish(&sink) && sink.crc == expected) ... switch to new image
+ *
+ * Flash erase/write still stops CPU while flash is busy, but network keeps
+ * filling other buffer in between, instead of waiting for each write.
+ * With HAL_LINUX writer is a task of hal_linux.c and flash is a file.
+ */
+#ifdef HAL_LINUX
+#include "hal.h"
+#else
+#include "esp_common.h"
+#endif
+#include "esp8266stuff.h"
+
+/* CRC32 (IEEE 802.3), nibble table */
+static const uint32_t crc32_table[16] = {
+        0x00000000, 0x1DB71064, 0x3B6E20C8, 0x26D930AC,
+        0x76DC4190, 0x6B6B51F4, 0x4DB26158, 0x5005713C,
+        0xEDB88320, 0xF00F9344, 0xD6D6A3E8, 0xCB61B38C,
+        0x9B64C2B0, 0x86D3D2D4, 0xA00AE278, 0xBDBDF21C
+};
+
+/* Start with crc 0, pass previous result to continue */
+uint32_t crc32_update(uint32_t crc, const uint8_t *buf, uint32_t len) {
+        crc = ~crc;
+        while (len--) {
+                crc ^= *buf++;
+                crc = (crc >> 4) ^ crc32_table[crc & 0x0F];
+                crc = (crc >> 4) ^ crc32_table[crc & 0x0F];
+        }
+        return ~crc;
+}
+
+typedef struct {
+        uint8_t idx;
+        uint16_t len;
+        uint32_t addr;
+} ota_job_t;
+
+static void ota_flash(ota_sink_t *s, ota_job_t *job) {
+        /* spi_flash_write wants multiple of 4 */
+        while (job->len & 3)
+                s->buf[job->idx][job->len++] = 0xFF;
+
+        if (spi_flash_erase_sector(job->addr / OTA_SECTOR) != SPI_FLASH_RESULT_OK ||
+            spi_flash_write(job->addr, (uint32_t *)s->buf[job->idx], job->len) != SPI_FLASH_RESULT_OK)
+                s->error = 1;
+}
+
+static void ota_writer(void *arg) {
+        ota_sink_t *s = arg;
+        ota_job_t job;
+
+        for (;;) {
+                xQueueReceive(s->todo, &job, portMAX_DELAY);
+                /* Zero length - finish */
+                if (!job.len) {
+                        xQueueSend(s->done, &job.idx, portMAX_DELAY);
+                        break;
+                }
+                ota_flash(s, &job);
+                xQueueSend(s->done, &job.idx, portMAX_DELAY);
+        }
+        vTaskDelete(NULL);
+}
+
+/* Hand over current buffer to writer and get free one */
+static void ota_submit(ota_sink_t *s) {
+        ota_job_t job;
+
+        job.idx = s->cur;
+        job.len = s->fill;
+        job.addr = s->addr + s->size - s->fill;
+        xQueueSend(s->todo, &job, portMAX_DELAY);
+        xQueueReceive(s->done, &s->cur, portMAX_DELAY);
+        s->fill = 0;
+}
+
+/* Buffers and queues, whatever was allocated */
+static void ota_sink_free(ota_sink_t *s) {
+        if (s->todo)
+                vQueueDelete(s->todo);
+        if (s->done)
+                vQueueDelete(s->done);
+        s->todo = s->done = NULL;
+        free(s->buf[0]);
+        free(s->buf[1]);
+        s->buf[0] = s->buf[1] = NULL;
+}
+
+/* addr must be sector aligned, returns 0 on success */
+int ota_sink_begin(ota_sink_t *s, uint32_t addr) {
+        uint8_t i;
+
+        memset(s, 0, sizeof(*s));
+        if (addr % OTA_SECTOR)
+                return -1;
+        s->addr = addr;
+        /* Buffers first, writer task is started only when all is there */
+        for (i = 0; i < 2; i++) {
+                s->buf[i] = malloc(OTA_SECTOR);
+                if (!s->buf[i]) {
+                        ota_sink_free(s);
+                        return -1;
+                }
+        }
+        s->todo = xQueueCreate(2, sizeof(ota_job_t));
+        s->done = xQueueCreate(2, sizeof(uint8_t));
+        if (!s->todo || !s->done) {
+                ota_sink_free(s);
+                return -1;
+        }
+        /* Both buffers are free, first one to fill */
+        i = 1;
+        xQueueSend(s->done, &i, 0);
+        if (xTaskCreate(ota_writer, (const signed char *)"ota", 256, s, 2, NULL) != pdPASS) {
+                ota_sink_free(s);
+                return -1;
+        }
+        s->cur = 0;
+        return 0;
+}
+
+/* Body callback for http_parse() */
+void ota_sink_write(void *ctx, char *buf, int len) {
+        ota_sink_t *s = ctx;
+        int n;
+
+        if (s->error)
+                return;
+
+        s->crc = crc32_update(s->crc, (uint8_t *)buf, len);
+        while (len > 0) {
+                n = OTA_SECTOR - s->fill;
+                if (n > len)
+                        n = len;
+                memcpy(&s->buf[s->cur][s->fill], buf, n);
+                s->fill += n;
+                s->size += n;
+                buf += n;
+                len -= n;
+                if (s->fill == OTA_SECTOR)
+                        ota_submit(s);
+        }
+}
+
+/* Write rest and wait for writer, returns 0 if whole image is in flash */
+int ota_sink_finish(ota_sink_t *s) {
+        ota_job_t job;
+        uint8_t idx;
+
+        if (s->fill)
+                ota_submit(s);
+        /* Writer returns both buffers when all done */
+        job.idx = s->cur;
+        job.len = 0;
+        xQueueSend(s->todo, &job, portMAX_DELAY);
+        xQueueReceive(s->done, &idx, portMAX_DELAY);
+        xQueueReceive(s->done, &idx, portMAX_DELAY);
+        ota_sink_free(s);
+        return s->error ? -1 : 0;
+}
@@ -1,17 +1,40 @@
+#ifdef HAL_LINUX
+#include "hal.h"
+#else
 #include <fcntl.h>
 #include <stdio.h>
 #include <driver/gpio.h>
 #include <unistd.h>
 #include "freertos/FreeRTOS.h"
 #include <freertos/task.h>
-#include <limits.h>
+#include <string.h>
 #include "esp_log.h"
 #include "esp8266/gpio_struct.h"
+#include "esp_sleep.h"
+#ifdef OW_UART
+#include <driver/uart.h>
+#endif
+#endif
+#include "esp8266stuff.h"
+#include "stats.h"
 
+/* UART backend owns UART0 pins, so driver doesn't print there */
+#ifdef OW_UART
+#define OW_PRINTF(...)  do { } while (0)
+#define OW_LOGE(...)    do { } while (0)
+#else
+#define OW_PRINTF(...)  printf(__VA_ARGS__)
+#define OW_LOGE(...)    ESP_LOGE(__VA_ARGS__)
+#endif
 
 /* ESP12 PIN4 and PIN5 sometimes swapped :@ */
 #define OW_PIN_DATA     5
-#define OW_PIN_POWER    4
+#define OW_PIN_POWER    4   /* sensors VDD (and pullup), see onewire_power_up() */
+
+/* After power up, before first reset */
+#ifndef OW_POWER_SETTLE_MS
+#define OW_POWER_SETTLE_MS  10
+#endif
 #define OW_GET_IN()     ( fast_pin_get(OW_PIN_DATA) )
 #define OW_OUT_LOW()    ( fast_pin_set(OW_PIN_DATA, 0) )
 #define OW_OUT_HIGH()   ( fast_pin_set(OW_PIN_DATA, 1) )
@@ -19,6 +42,12 @@
 #define OW_DIR_OUT()    ( fast_pin_dir(OW_PIN_DATA, 1) )
 
 
+/* Bus powered by default, onewire_power_down() to cut it */
+static void onewire_power_setup() {
+    gpio_set_direction(OW_PIN_POWER, GPIO_MODE_OUTPUT);
+    gpio_set_level(OW_PIN_POWER, 1);
+}
+
 void onewire_gpio_setup() {
     gpio_config_t io_conf;
     io_conf.intr_type = GPIO_INTR_DISABLE;
@@ -27,15 +56,16 @@ void onewire_gpio_setup() {
     io_conf.pull_down_en = 0;
     io_conf.pull_up_en = 0;
     gpio_config(&io_conf);
-    gpio_set_direction(OW_PIN_POWER, GPIO_MODE_OUTPUT);
-    gpio_set_level(OW_PIN_POWER, 1);
+    onewire_power_setup();
 }
 
+#ifndef HAL_LINUX
 IRAM_ATTR inline void __attribute__ ((always_inline)) fast_pin_set(gpio_num_t gpio_num, uint32_t level) {
+    /* Write 1 to set/clear registers, no need to read them */
     if (level) {
-        GPIO.out_w1ts |= (0x1 << gpio_num);
+        GPIO.out_w1ts = (0x1 << gpio_num);
     } else {
-        GPIO.out_w1tc |= (0x1 << gpio_num);
+        GPIO.out_w1tc = (0x1 << gpio_num);
     }
 }
 
@@ -47,43 +77,331 @@ IRAM_ATTR inline int __attribute__ ((always_inline)) fast_pin_get(gpio_num_t gpi
 IRAM_ATTR inline void __attribute__ ((always_inline)) fast_pin_dir(gpio_num_t gpio_num, gpio_mode_t mode)
 {
     if (mode) {
-        GPIO.enable_w1ts |= (0x1 << gpio_num);
+        GPIO.enable_w1ts = (0x1 << gpio_num);
     } else {
-        GPIO.enable_w1tc |= (0x1 << gpio_num);
+        GPIO.enable_w1tc = (0x1 << gpio_num);
     }
 }
 
+/* Same for many pins at once, by mask */
+IRAM_ATTR inline void __attribute__ ((always_inline)) fast_mask_set(uint32_t mask, uint32_t level) {
+    if (level) {
+        GPIO.out_w1ts = mask;
+    } else {
+        GPIO.out_w1tc = mask;
+    }
+}
+
+IRAM_ATTR inline void __attribute__ ((always_inline)) fast_mask_dir(uint32_t mask, gpio_mode_t mode)
+{
+    if (mode) {
+        GPIO.enable_w1ts = mask;
+    } else {
+        GPIO.enable_w1tc = mask;
+    }
+}
+
+IRAM_ATTR inline uint32_t __attribute__ ((always_inline)) fast_in(void)
+{
+    return GPIO.in;
+}
+
 
 
 // 12.5ns with 80MHz clock
-IRAM_ATTR inline void __attribute__ ((always_inline)) WaitUS(uint32_t delta)
+IRAM_ATTR inline void __attribute__ ((always_inline)) WaitCycles(uint32_t delta)
 {
     uint32_t cycleCount;
     uint32_t waitUntil;
-    delta *= 80;
-    delta -= 5;
+    if (delta > 5)
+        delta -= 5;
     __asm__ __volatile__("rsr     %0, ccount":"=a" (waitUntil));
     waitUntil += delta;
     do {
         __asm__ __volatile__("rsr     %0, ccount":"=a" (cycleCount));
-    } while (waitUntil > cycleCount);
+    } while ((int32_t)(waitUntil - cycleCount) > 0);
+}
+
+IRAM_ATTR inline uint32_t __attribute__ ((always_inline)) GetCycleCount(void)
+{
+    uint32_t cycleCount;
+    __asm__ __volatile__("rsr     %0, ccount":"=a" (cycleCount));
+    return cycleCount;
+}
+
+/* Wait for absolute cycle count, time spent since last wait doesn't add up */
+IRAM_ATTR inline void __attribute__ ((always_inline)) WaitUntilCycle(uint32_t until)
+{
+    while ((int32_t)(until - GetCycleCount()) > 0)
+        ;
+}
+#endif
+
+static IRAM_ATTR inline void __attribute__ ((always_inline)) WaitUS(uint32_t delta)
+{
+    WaitCycles(delta * 80);
 }
 
+/*
+ * Slot timings in CPU cycles, so overdrive fractions of us are possible.
+ * Letters as in Maxim AN126
+ */
+#define US(x)   ( (uint32_t)((x) * 80) )
+
+typedef struct {
+    uint32_t reset_low;     /* H */
+    uint32_t presence;      /* I, release to presence sample */
+    uint32_t reset_tail;    /* J */
+    uint32_t w1_low;        /* A */
+    uint32_t w1_rest;       /* B */
+    uint32_t w0_low;        /* C */
+    uint32_t w0_rest;       /* D */
+    uint32_t r_low;         /* A */
+    uint32_t r_sample;      /* E */
+    uint32_t r_rest;        /* F */
+} ow_timing_t;
+
+static const ow_timing_t ow_timing[] = {
+    /* OW_SPEED_STANDARD, ~15.4kbit/s */
+    { US(480), US(70), US(410), US(10), US(55), US(65), US(5), US(3), US(10), US(50) },
+    /* OW_SPEED_OVERDRIVE, ~125kbit/s */
+    { US(70), US(8.5), US(40), US(1), US(7.5), US(7.5), US(2.5), US(1), US(1), US(7) },
+};
+
+static int ow_speed = OW_SPEED_STANDARD;
+static const ow_timing_t *ow_t = &ow_timing[OW_SPEED_STANDARD];
+
+
+/*
+ * How long interrupts stay masked while talking to bus
+ * OW_LOCK_BIT         - only timing critical part of each slot (few us),
+ *                       recovery between slots runs with interrupts enabled
+ * OW_LOCK_BYTE        - whole byte, ~560us
+ * OW_LOCK_TRANSACTION - between onewire_lock() and onewire_unlock(), best bus
+ *                       throughput, worst interrupt latency
+ * Locks are not nestable, so only one level does real locking
+ */
+#define OW_LOCK_BIT         0
+#define OW_LOCK_BYTE        1
+#define OW_LOCK_TRANSACTION 2
+
+#ifndef OW_LOCK_GRANULARITY
+#define OW_LOCK_GRANULARITY OW_LOCK_BIT
+#endif
+
+/* With DRV_STATS each masked window and bus operation is timed by CCOUNT */
+#ifdef DRV_STATS
+static uint32_t ow_masked_start, ow_xfer_start, ow_reset_start, ow_slot_start;
+#endif
+#define OW_INTR_LOCK()      do { vPortETSIntrLock(); STATS_BEGIN(ow_masked_start); } while (0)
+#define OW_INTR_UNLOCK()    do { STATS_END(STATS_OW_MASKED, ow_masked_start); vPortETSIntrUnlock(); } while (0)
+
+#if OW_LOCK_GRANULARITY == OW_LOCK_BIT
+#define OW_SLOT_LOCK()      OW_INTR_LOCK()
+#define OW_SLOT_UNLOCK()    OW_INTR_UNLOCK()
+#else
+#define OW_SLOT_LOCK()      do { } while (0)
+#define OW_SLOT_UNLOCK()    do { } while (0)
+#endif
+
+#if OW_LOCK_GRANULARITY == OW_LOCK_BYTE
+#define OW_BYTE_LOCK()      OW_INTR_LOCK()
+#define OW_BYTE_UNLOCK()    OW_INTR_UNLOCK()
+#else
+#define OW_BYTE_LOCK()      do { } while (0)
+#define OW_BYTE_UNLOCK()    do { } while (0)
+#endif
+
+#if OW_LOCK_GRANULARITY == OW_LOCK_TRANSACTION
+#define OW_RESET_LOCK()     do { } while (0)
+#define OW_RESET_UNLOCK()   do { } while (0)
+#else
+#define OW_RESET_LOCK()     OW_INTR_LOCK()
+#define OW_RESET_UNLOCK()   OW_INTR_UNLOCK()
+#endif
+
+#if defined(OW_UART) && OW_LOCK_GRANULARITY == OW_LOCK_TRANSACTION
+#error "OW_UART waits for UART, can't work with interrupts masked"
+#endif
+
+/* Wrap whole command sequence, does something only for OW_LOCK_TRANSACTION */
+IRAM_ATTR void onewire_lock() {
+#if OW_LOCK_GRANULARITY == OW_LOCK_TRANSACTION
+    OW_INTR_LOCK();
+#endif
+    STATS_BEGIN(ow_xfer_start);
+}
+
+IRAM_ATTR void onewire_unlock() {
+    STATS_END(STATS_OW_XFER, ow_xfer_start);
+#if OW_LOCK_GRANULARITY == OW_LOCK_TRANSACTION
+    OW_INTR_UNLOCK();
+#endif
+}
 
+/*
+ * Slot timing for following resets and slots. Standard speed reset returns all
+ * devices to standard speed, overdrive reset is too short for standard devices.
+ */
+void onewire_set_speed(int speed) {
+    ow_speed = speed;
+    ow_t = &ow_timing[speed];
+}
+
+#ifdef OW_UART
+/*
+ * UART backend (define OW_UART): TX through open drain (or diode) to bus, RX on
+ * bus, so UART receives echo of each byte with whatever devices added to it.
+ * Each slot is one byte: 0xFF - write 1/read (low only for start bit), 0x00 -
+ * write 0. Reset is 0xF0 at lower baudrate, presence changes echo.
+ * No bit-banging and no masked interrupts, byte transfers go through FIFO.
+ * UART0 is swapped to GPIO15 (TX) / GPIO13 (RX), as UART1 has no RX.
+ * Console must be on UART1 (GPIO2, menuconfig CONSOLE_UART_NUM), otherwise
+ * every log line from any task goes out on the bus.
+ */
+#if defined(CONFIG_CONSOLE_UART_NUM) && CONFIG_CONSOLE_UART_NUM == 0
+#error "OW_UART takes UART0, set console to UART1"
+#endif
+#define OW_UART_NUM     UART_NUM_0
+#define OW_UART_TIMEOUT ( 20 / portTICK_RATE_MS + 1 )
+
+typedef struct {
+    uint32_t reset_baud;
+    uint8_t reset_byte;
+    uint32_t slot_baud;
+} ow_uart_t;
+
+static const ow_uart_t ow_uart[] = {
+    /* OW_SPEED_STANDARD, reset 520us, write 0 78us, write 1 8.7us */
+    { 9600, 0xF0, 115200 },
+    /* OW_SPEED_OVERDRIVE, reset 52us, write 0 9us, write 1 1us */
+    { 115200, 0xE0, 1000000 },
+};
+
+int onewire_uart_setup() {
+    uart_config_t cfg = {
+        .baud_rate = 115200,
+        .data_bits = UART_DATA_8_BITS,
+        .parity = UART_PARITY_DISABLE,
+        .stop_bits = UART_STOP_BITS_1,
+        .flow_ctrl = UART_HW_FLOWCTRL_DISABLE,
+    };
+
+    if (uart_param_config(OW_UART_NUM, &cfg) != ESP_OK)
+        return -1;
+    if (uart_driver_install(OW_UART_NUM, 256, 0, 0, NULL, 0) != ESP_OK)
+        return -1;
+    uart_enable_swap();
+    onewire_power_setup();
+    return 0;
+}
+
+/* Send slot bytes, echo replaces them, returns number of bytes echoed */
+static int ow_uart_xfer(uint8_t *buf, int len) {
+    uart_write_bytes(OW_UART_NUM, (const char *)buf, len);
+    return uart_read_bytes(OW_UART_NUM, buf, len, OW_UART_TIMEOUT);
+}
+
+int onewire_reset() {
+    const ow_uart_t *u = &ow_uart[ow_speed];
+    uint8_t b = u->reset_byte;
+    int r;
+
+    STATS_BEGIN(ow_reset_start);
+    uart_flush_input(OW_UART_NUM);
+    uart_set_baudrate(OW_UART_NUM, u->reset_baud);
+    // Is OW device present it will pull low and change echo
+    r = ow_uart_xfer(&b, 1) != 1 || b == u->reset_byte;
+    uart_set_baudrate(OW_UART_NUM, u->slot_baud);
+    STATS_END(STATS_OW_RESET, ow_reset_start);
+    return (r);
+}
+
+void onewire_write_bit(int bit) {
+    uint8_t b = bit ? 0xFF : 0x00;
+
+    STATS_BEGIN(ow_slot_start);
+    ow_uart_xfer(&b, 1);
+    STATS_END(STATS_OW_SLOT, ow_slot_start);
+}
+
+int onewire_read_bit() {
+    uint8_t b = 0xFF;
+    int r;
+
+    STATS_BEGIN(ow_slot_start);
+    r = ow_uart_xfer(&b, 1) == 1 && b == 0xFF;
+    STATS_END(STATS_OW_SLOT, ow_slot_start);
+    return (r);
+}
+
+/* Whole byte is queued at once, 8 slots back to back */
+void onewire_write(int data) {
+    uint8_t buf[8];
+    int count;
+
+    for (count = 0; count < 8; ++count)
+        buf[count] = ((data >> count) & 0x1) ? 0xFF : 0x00;
+    ow_uart_xfer(buf, 8);
+}
+
+int onewire_read() {
+    uint8_t buf[8];
+    int count, data = 0;
+
+    memset(buf, 0xFF, sizeof(buf));
+    if (ow_uart_xfer(buf, 8) != 8)
+        return 0xFF;
+    for (count = 0; count < 8; ++count) {
+        if (buf[count] == 0xFF)
+            data |= (1 << count);
+    }
+    return ( data );
+}
+
+/* Slots of whole transaction, 8 bytes (64 slot bytes) per UART write */
+static void ow_slots(const uint8_t *tx, uint8_t *rx, int len, int rfrom) {
+    uint8_t buf[64];
+    int i, n;
+
+    memset(rx, 0, len);
+    while (len > 0) {
+        n = len > 8 ? 8 : len;
+        for (i = 0; i < n * 8; i++)
+            buf[i] = ((tx[i >> 3] >> (i & 7)) & 0x1) ? 0xFF : 0x00;
+        if (ow_uart_xfer(buf, n * 8) != n * 8)
+            memset(buf, 0xFF, sizeof(buf));
+        for (i = 0; i < n * 8; i++)
+            rx[i >> 3] |= (buf[i] == 0xFF) << (i & 7);
+        tx += n;
+        rx += n;
+        len -= n;
+    }
+}
+#else
 // OK if just using a single permanently connected device
 IRAM_ATTR int onewire_reset() {
     int r;
 
+    STATS_BEGIN(ow_reset_start);
     OW_DIR_OUT();
-    vPortETSIntrLock();
+    /*
+     * Longer standard reset pulse is harmless, only presence sample is critical.
+     * Stretched overdrive reset might become standard reset, so lock it whole.
+     */
+    if (ow_speed == OW_SPEED_OVERDRIVE)
+        OW_RESET_LOCK();
     OW_OUT_LOW();
-    WaitUS(480);
+    WaitCycles(ow_t->reset_low);
+    if (ow_speed == OW_SPEED_STANDARD)
+        OW_RESET_LOCK();
     OW_DIR_IN();
-    WaitUS(70);
+    WaitCycles(ow_t->presence);
     r = OW_GET_IN(); // Is OW device present it will pull low
-    vPortETSIntrUnlock();
+    OW_RESET_UNLOCK();
 
-    WaitUS(410); // TODO: Why?
+    WaitCycles(ow_t->reset_tail); // Rest of presence pulse
+    STATS_END(STATS_OW_RESET, ow_reset_start);
     // if r - 1 - bad, means device didnt pulled low
     return (r);
 }
@@ -91,6 +409,47 @@ IRAM_ATTR int onewire_reset() {
 
 #define OW_RECOVERY_TIME 10 // Depends on wire length
 
+/*
+ * Single slot, interrupts masked only while line is low (and until sample
+ * on read), rest of slot is recovery and can be stretched by interrupts
+ */
+IRAM_ATTR void onewire_write_bit(int bit) {
+    STATS_BEGIN(ow_slot_start);
+    OW_SLOT_LOCK();
+    OW_DIR_OUT();
+    if (bit) {
+        OW_OUT_LOW();
+        WaitCycles(ow_t->w1_low);
+        OW_OUT_HIGH();
+        OW_SLOT_UNLOCK();
+        WaitCycles(ow_t->w1_rest);
+    } else {
+        OW_OUT_LOW();
+        WaitCycles(ow_t->w0_low);
+        OW_OUT_HIGH();
+        OW_SLOT_UNLOCK();
+        WaitCycles(ow_t->w0_rest);
+    }
+    STATS_END(STATS_OW_SLOT, ow_slot_start);
+}
+
+IRAM_ATTR int onewire_read_bit() {
+    int r;
+
+    STATS_BEGIN(ow_slot_start);
+    OW_SLOT_LOCK();
+    OW_DIR_OUT();
+    OW_OUT_LOW();
+    WaitCycles(ow_t->r_low);
+    OW_DIR_IN();
+    WaitCycles(ow_t->r_sample);
+    r = OW_GET_IN();
+    OW_SLOT_UNLOCK();
+    WaitCycles(ow_t->r_rest);
+    STATS_END(STATS_OW_SLOT, ow_slot_start);
+    return (r);
+}
+
 /*********************** onewire_write() ********************************/
 /*This function writes a byte to the sensor.*/
 /* */
@@ -100,69 +459,132 @@ IRAM_ATTR int onewire_reset() {
 
 
 IRAM_ATTR void onewire_write(int data) {
-    int count, temp;
-
-    vPortETSIntrLock();
+    int count;
 
-    for (count = 0; count < 8; ++count) {
-        OW_DIR_OUT();
-        temp = data >> count;
-        temp &= 0x1;
-        if (temp) {
-            OW_OUT_LOW();
-            WaitUS(10);
-            OW_OUT_HIGH();
-            WaitUS(55);
-        } else {
-            OW_OUT_LOW();
-            WaitUS(65);
-            OW_OUT_HIGH();
-            WaitUS(5);
-        }
-    }
-    vPortETSIntrUnlock();
+    OW_BYTE_LOCK();
+    for (count = 0; count < 8; ++count)
+        onewire_write_bit((data >> count) & 0x1);
+    OW_BYTE_UNLOCK();
 }
 
 IRAM_ATTR int onewire_read() {
     int count, data = 0;
-    vPortETSIntrLock();
+
+    OW_BYTE_LOCK();
     for (count = 0; count < 8; ++count) {
-        OW_DIR_OUT();
-        OW_OUT_LOW();
-        WaitUS(3);
-        OW_DIR_IN();
-        WaitUS(10);
-        if (OW_GET_IN())
+        if (onewire_read_bit())
             data |= (1 << count);
-        WaitUS(50);
     }
-    vPortETSIntrUnlock();
+    OW_BYTE_UNLOCK();
     return ( data );
 }
 
-#define CRC8_POLYNOMIAL 0x8C
+/*
+ * Slots of whole transaction, timing planned once before first slot: write 1
+ * and read are same slot (read sample taken for every 1 bit), pin level stays
+ * low and slot is made by direction alone, one register write per edge.
+ * Each slot starts at fixed period (by its kind, bytes from rfrom are read)
+ * from start of previous one, so code between slots doesn't stretch them,
+ * interrupts only can.
+ */
+static IRAM_ATTR void ow_slots(const uint8_t *tx, uint8_t *rx, int len, int rfrom) {
+    uint32_t low[2] = { ow_t->w0_low, ow_t->r_low };
+    uint32_t sample = ow_t->r_low + ow_t->r_sample;
+    /* write 0, write 1, read */
+    uint32_t period[3] = { ow_t->w0_low + ow_t->w0_rest, ow_t->w1_low + ow_t->w1_rest,
+                           sample + ow_t->r_rest };
+    uint32_t start;
+    int i, bit;
+
+    rfrom *= 8;
+
+    memset(rx, 0, len);
+    OW_DIR_IN();
+    OW_OUT_LOW();
+    start = GetCycleCount();
+    for (i = 0; i < len * 8; i++) {
+        bit = (tx[i >> 3] >> (i & 7)) & 0x1;
+        if (!(i & 7))
+            OW_BYTE_LOCK();
+        WaitUntilCycle(start);
+        OW_SLOT_LOCK();
+        start = GetCycleCount();
+        OW_DIR_OUT();
+        WaitUntilCycle(start + low[bit]);
+        OW_DIR_IN();
+        if (bit) {
+            WaitUntilCycle(start + sample);
+            rx[i >> 3] |= OW_GET_IN() << (i & 7);
+        }
+        OW_SLOT_UNLOCK();
+        if ((i & 7) == 7)
+            OW_BYTE_UNLOCK();
+        start += period[i >= rfrom ? 2 : bit];
+    }
+    WaitUntilCycle(start);
+    // Released, and bit-banged slots find level they expect
+    OW_OUT_HIGH();
+}
+#endif /* OW_UART */
+
+/*
+ * Dallas/Maxim CRC8 (x^8 + x^5 + x^4 + 1), table driven.
+ * OW_CRC8_TABLE 256 - one lookup per byte, table takes 256 bytes
+ * OW_CRC8_TABLE 16  - two lookups per byte (by nibble), table takes 16 bytes
+ */
+#ifndef OW_CRC8_TABLE
+#define OW_CRC8_TABLE 16
+#endif
+
+#if OW_CRC8_TABLE == 256
+static const uint8_t crc8_table[256] = {
+    0x00, 0x5E, 0xBC, 0xE2, 0x61, 0x3F, 0xDD, 0x83, 0xC2, 0x9C, 0x7E, 0x20, 0xA3, 0xFD, 0x1F, 0x41,
+    0x9D, 0xC3, 0x21, 0x7F, 0xFC, 0xA2, 0x40, 0x1E, 0x5F, 0x01, 0xE3, 0xBD, 0x3E, 0x60, 0x82, 0xDC,
+    0x23, 0x7D, 0x9F, 0xC1, 0x42, 0x1C, 0xFE, 0xA0, 0xE1, 0xBF, 0x5D, 0x03, 0x80, 0xDE, 0x3C, 0x62,
+    0xBE, 0xE0, 0x02, 0x5C, 0xDF, 0x81, 0x63, 0x3D, 0x7C, 0x22, 0xC0, 0x9E, 0x1D, 0x43, 0xA1, 0xFF,
+    0x46, 0x18, 0xFA, 0xA4, 0x27, 0x79, 0x9B, 0xC5, 0x84, 0xDA, 0x38, 0x66, 0xE5, 0xBB, 0x59, 0x07,
+    0xDB, 0x85, 0x67, 0x39, 0xBA, 0xE4, 0x06, 0x58, 0x19, 0x47, 0xA5, 0xFB, 0x78, 0x26, 0xC4, 0x9A,
+    0x65, 0x3B, 0xD9, 0x87, 0x04, 0x5A, 0xB8, 0xE6, 0xA7, 0xF9, 0x1B, 0x45, 0xC6, 0x98, 0x7A, 0x24,
+    0xF8, 0xA6, 0x44, 0x1A, 0x99, 0xC7, 0x25, 0x7B, 0x3A, 0x64, 0x86, 0xD8, 0x5B, 0x05, 0xE7, 0xB9,
+    0x8C, 0xD2, 0x30, 0x6E, 0xED, 0xB3, 0x51, 0x0F, 0x4E, 0x10, 0xF2, 0xAC, 0x2F, 0x71, 0x93, 0xCD,
+    0x11, 0x4F, 0xAD, 0xF3, 0x70, 0x2E, 0xCC, 0x92, 0xD3, 0x8D, 0x6F, 0x31, 0xB2, 0xEC, 0x0E, 0x50,
+    0xAF, 0xF1, 0x13, 0x4D, 0xCE, 0x90, 0x72, 0x2C, 0x6D, 0x33, 0xD1, 0x8F, 0x0C, 0x52, 0xB0, 0xEE,
+    0x32, 0x6C, 0x8E, 0xD0, 0x53, 0x0D, 0xEF, 0xB1, 0xF0, 0xAE, 0x4C, 0x12, 0x91, 0xCF, 0x2D, 0x73,
+    0xCA, 0x94, 0x76, 0x28, 0xAB, 0xF5, 0x17, 0x49, 0x08, 0x56, 0xB4, 0xEA, 0x69, 0x37, 0xD5, 0x8B,
+    0x57, 0x09, 0xEB, 0xB5, 0x36, 0x68, 0x8A, 0xD4, 0x95, 0xCB, 0x29, 0x77, 0xF4, 0xAA, 0x48, 0x16,
+    0xE9, 0xB7, 0x55, 0x0B, 0x88, 0xD6, 0x34, 0x6A, 0x2B, 0x75, 0x97, 0xC9, 0x4A, 0x14, 0xF6, 0xA8,
+    0x74, 0x2A, 0xC8, 0x96, 0x15, 0x4B, 0xA9, 0xF7, 0xB6, 0xE8, 0x0A, 0x54, 0xD7, 0x89, 0x6B, 0x35,
+};
+
+uint8_t crc8_update(uint8_t crc, const uint8_t *buffer, uint8_t length)
+{
+    while (length--)
+        crc = crc8_table[crc ^ *buffer++];
+    return crc;
+}
+#else
+static const uint8_t crc8_table[16] = {
+    0x00, 0x9D, 0x23, 0xBE, 0x46, 0xDB, 0x65, 0xF8, 0x8C, 0x11, 0xAF, 0x32, 0xCA, 0x57, 0xE9, 0x74
+};
+
+uint8_t crc8_update(uint8_t crc, const uint8_t *buffer, uint8_t length)
+{
+    while (length--) {
+        crc ^= *buffer++;
+        crc = (crc >> 4) ^ crc8_table[crc & 0x0F];
+        crc = (crc >> 4) ^ crc8_table[crc & 0x0F];
+    }
+    return crc;
+}
+#endif
+
 uint8_t crc8_data(uint8_t *buffer, uint8_t length)
 {
     uint8_t crc8 = 0, valid = 0;
-    uint8_t inByte, byteCount, bitCount, mix;
 
-    for (byteCount = 0; byteCount < length; byteCount++)
-    {
-        inByte = buffer[byteCount];
-        if (inByte)
-        {
-            valid = 1;
-        }
-        for (bitCount = 0; bitCount < CHAR_BIT; bitCount++)
-        {
-            mix = (crc8 ^ inByte) & 0x01;
-            crc8 >>= 1;
-            if (mix)
-            {
-                crc8 ^= CRC8_POLYNOMIAL;
-            }
-            inByte >>= 1;
-        }
+    while (length--) {
+        valid |= *buffer;
+        crc8 = crc8_update(crc8, buffer++, 1);
     }
     if (!valid)
     {
@@ -172,132 +594,898 @@ uint8_t crc8_data(uint8_t *buffer, uint8_t length)
     return crc8;
 }
 
-int ds1820_read(double *temp) {
-    uint8_t i = 0, data[9], type = 0;
-    int32_t raw;
-    uint8_t crc8 = 0xFF;
+/*
+ * Dallas CRC16 (x^16 + x^15 + x^2 + 1), used by DS2406, DS2438, DS28EA00 etc
+ * Parity trick from Maxim AN27, no big table needed
+ */
+static const uint8_t oddparity[16] =
+    { 0, 1, 1, 0, 1, 0, 0, 1, 1, 0, 0, 1, 0, 1, 1, 0 };
 
-    /*
-    // Can be used to verify calibration of WaitUS
-    uint32_t d1, d2;
-    vPortETSIntrLock();
-    __asm__ __volatile__("rsr     %0, ccount":"=a" (d1));
-    WaitUS(10);
-    __asm__ __volatile__("rsr     %0, ccount":"=a" (d2));
-    vPortETSIntrUnlock();
-    printf("%d\r\n", d2-d1);
+uint16_t crc16_update(uint16_t crc, const uint8_t *buffer, uint16_t length)
+{
+    uint16_t cdata;
+
+    while (length--) {
+        cdata = (*buffer++ ^ crc) & 0xFF;
+        crc >>= 8;
+        if (oddparity[cdata & 0x0F] ^ oddparity[cdata >> 4])
+            crc ^= 0xC001;
+        cdata <<= 6;
+        crc ^= cdata;
+        cdata <<= 1;
+        crc ^= cdata;
+    }
+    return crc;
+}
+
+/* Devices send inverted CRC16 LSB first, return 1 if it matches */
+int crc16_check(const uint8_t *buffer, uint16_t length, const uint8_t *inverted)
+{
+    uint16_t crc = ~crc16_update(0, buffer, length);
 
+    return (inverted[0] == (crc & 0xFF)) && (inverted[1] == (crc >> 8));
+}
+
+void onewire_search_reset(onewire_search_t *s) {
+    memset(s, 0, sizeof(*s));
+}
 
+/* Same, but search finds only devices with alarm flag set */
+void onewire_alarm_search_reset(onewire_search_t *s) {
+    memset(s, 0, sizeof(*s));
+    s->cmd = 0xEC;
+}
+
+/* Start over, same kind of search */
+static void onewire_search_restart(onewire_search_t *s) {
+    uint8_t cmd = s->cmd;
 
-    __asm__ __volatile__("rsr     %0, ccount":"=a" (d1));
-    WaitUS(100);
-    __asm__ __volatile__("rsr     %0, ccount":"=a" (d2));
-    printf("%d\r\n", d2-d1);
+    onewire_search_reset(s);
+    s->cmd = cmd;
+}
 
+/*
+ * SEARCH ROM (0xF0) or ALARM SEARCH (0xEC), Maxim AN187 algorithm. Each call
+ * finds next device, ROM is left in s->rom. Returns 1 if device found, 0 when
+ * no more devices (or bus error, then state is reset and search can be
+ * restarted)
+ */
+int onewire_search(onewire_search_t *s) {
+    int id_bit_number = 1, last_zero = 0, rom_byte = 0;
+    int id_bit, cmp_id_bit, dir;
+    uint8_t rom_mask = 1;
 
-    vPortETSIntrLock();
-    __asm__ __volatile__("rsr     %0, ccount":"=a" (d1));
-    WaitUS(200);
-    __asm__ __volatile__("rsr     %0, ccount":"=a" (d2));
-    vPortETSIntrUnlock();
-    printf("%d\r\n", d2-d1);
-    */
+    if (s->last_device)
+        return 0;
 
-    if (onewire_reset())
-        return -1; // Device not found
+    onewire_lock();
+    if (onewire_reset()) {
+        onewire_unlock();
+        onewire_search_restart(s);
+        return 0;
+    }
+
+    onewire_write(s->cmd ? s->cmd : 0xF0);
+    do {
+        id_bit = onewire_read_bit();
+        cmp_id_bit = onewire_read_bit();
+        /* Nobody answered */
+        if (id_bit && cmp_id_bit)
+            break;
+
+        if (id_bit != cmp_id_bit) {
+            /* All remaining devices have same bit here */
+            dir = id_bit;
+        } else {
+            /* Discrepancy, take same path as last time before last_discrepancy */
+            if (id_bit_number < s->last_discrepancy)
+                dir = (s->rom[rom_byte] & rom_mask) ? 1 : 0;
+            else
+                dir = (id_bit_number == s->last_discrepancy);
+            if (!dir)
+                last_zero = id_bit_number;
+        }
+
+        if (dir)
+            s->rom[rom_byte] |= rom_mask;
+        else
+            s->rom[rom_byte] &= ~rom_mask;
+        onewire_write_bit(dir);
+
+        id_bit_number++;
+        rom_mask <<= 1;
+        if (!rom_mask) {
+            rom_byte++;
+            rom_mask = 1;
+        }
+    } while (rom_byte < 8);
+    onewire_unlock();
+
+    if (id_bit_number < 65 || crc8_data(s->rom, 7) != s->rom[7]) {
+        onewire_search_restart(s);
+        return 0;
+    }
 
-    vTaskDelay(100 / portTICK_RATE_MS);
-    // Read ROM (and important - type)
-    onewire_write(0x33);
+    s->last_discrepancy = last_zero;
+    if (!last_zero)
+        s->last_device = 1;
+    return 1;
+}
+
+/* Enumerate up to max devices, return number found */
+int onewire_search_all(uint8_t (*roms)[8], int max) {
+    onewire_search_t s;
+    int n = 0;
+
+    onewire_search_reset(&s);
+    while (n < max && onewire_search(&s)) {
+        memcpy(roms[n], s.rom, 8);
+        n++;
+    }
+    return n;
+}
+
+/* Enumerate devices with alarm flag, up to max, return number found */
+int onewire_alarm_search_all(uint8_t (*roms)[8], int max) {
+    onewire_search_t s;
+    int n = 0;
+
+    onewire_alarm_search_reset(&s);
+    while (n < max && onewire_search(&s)) {
+        memcpy(roms[n], s.rom, 8);
+        n++;
+    }
+    return n;
+}
+
+/* MATCH ROM, next function command goes only to device with this ROM */
+void onewire_select(const uint8_t *rom) {
+    uint8_t i;
+
+    onewire_write(0x55);
     for (i = 0; i < 8; i++)
-        data[i] = onewire_read();
+        onewire_write(rom[i]);
+}
 
-    crc8 = crc8_data(data, 7);
-    type = data[0];
-    if (crc8 != data[7]) {
-        for (i = 0; i < 8; i++)
-            printf("rom[%d]%02x ", i, data[i]);
-        printf("\r\n");
+/*
+ * OVERDRIVE SKIP ROM, all overdrive capable devices switch to overdrive and
+ * following function command is for all of them. Returns 1 if no device
+ */
+int onewire_overdrive_skip() {
+    onewire_set_speed(OW_SPEED_STANDARD);
+    onewire_lock();
+    if (onewire_reset()) {
+        onewire_unlock();
+        return 1;
+    }
+    onewire_write(0x3C);
+    onewire_set_speed(OW_SPEED_OVERDRIVE);
+    onewire_unlock();
+    return 0;
+}
+
+/*
+ * OVERDRIVE MATCH ROM, only this device switches to overdrive, ROM itself
+ * already sent at overdrive speed. Later just use onewire_select() at overdrive,
+ * onewire_set_speed(OW_SPEED_STANDARD) to talk to standard devices again.
+ */
+int onewire_overdrive_match(const uint8_t *rom) {
+    uint8_t i;
+
+    onewire_set_speed(OW_SPEED_STANDARD);
+    onewire_lock();
+    if (onewire_reset()) {
+        onewire_unlock();
+        return 1;
+    }
+    onewire_write(0x69);
+    onewire_set_speed(OW_SPEED_OVERDRIVE);
+    for (i = 0; i < 8; i++)
+        onewire_write(rom[i]);
+    onewire_unlock();
+    return 0;
+}
 
-        printf("ROM CRC error\r\n");
-        return -5;
+/*
+ * Bit parallel engine: same slots on several buses (one pin each, by mask) at
+ * once, so K cables cost same bus time as one. Reads are taken from one
+ * snapshot of GPIO.in and split per pin, arrays are indexed by GPIO number.
+ */
+void onewire_multi_setup(uint32_t mask) {
+    gpio_config_t io_conf;
+    io_conf.intr_type = GPIO_INTR_DISABLE;
+    io_conf.mode = GPIO_MODE_OUTPUT;
+    io_conf.pin_bit_mask = mask;
+    io_conf.pull_down_en = 0;
+    io_conf.pull_up_en = 0;
+    gpio_config(&io_conf);
+}
+
+/* Returns mask of buses where some device answered with presence */
+IRAM_ATTR uint32_t onewire_multi_reset(uint32_t mask) {
+    uint32_t in;
+
+    STATS_BEGIN(ow_reset_start);
+    fast_mask_dir(mask, 1);
+    fast_mask_set(mask, 0);
+    WaitCycles(ow_t->reset_low);
+    OW_RESET_LOCK();
+    fast_mask_dir(mask, 0);
+    WaitCycles(ow_t->presence);
+    in = fast_in();
+    OW_RESET_UNLOCK();
+
+    WaitCycles(ow_t->reset_tail);
+    STATS_END(STATS_OW_RESET, ow_reset_start);
+    return ~in & mask;
+}
+
+/* Buses in ones write 1, rest of mask write 0, in same slot */
+IRAM_ATTR void onewire_multi_write_bit(uint32_t mask, uint32_t ones) {
+    STATS_BEGIN(ow_slot_start);
+    OW_SLOT_LOCK();
+    fast_mask_dir(mask, 1);
+    fast_mask_set(mask, 0);
+    WaitCycles(ow_t->w1_low);
+    fast_mask_set(mask & ones, 1);
+    WaitCycles(ow_t->w0_low - ow_t->w1_low);
+    fast_mask_set(mask, 1);
+    OW_SLOT_UNLOCK();
+    WaitCycles(ow_t->w0_rest);
+    STATS_END(STATS_OW_SLOT, ow_slot_start);
+}
+
+/* Returns GPIO.in snapshot at sample time, masked */
+IRAM_ATTR uint32_t onewire_multi_read_bit(uint32_t mask) {
+    uint32_t in;
+
+    STATS_BEGIN(ow_slot_start);
+    OW_SLOT_LOCK();
+    fast_mask_dir(mask, 1);
+    fast_mask_set(mask, 0);
+    WaitCycles(ow_t->r_low);
+    fast_mask_dir(mask, 0);
+    WaitCycles(ow_t->r_sample);
+    in = fast_in();
+    OW_SLOT_UNLOCK();
+    WaitCycles(ow_t->r_rest);
+    STATS_END(STATS_OW_SLOT, ow_slot_start);
+    return in & mask;
+}
+
+IRAM_ATTR void onewire_multi_write(uint32_t mask, int data) {
+    int count;
+
+    OW_BYTE_LOCK();
+    for (count = 0; count < 8; ++count)
+        onewire_multi_write_bit(mask, ((data >> count) & 0x1) ? mask : 0);
+    OW_BYTE_UNLOCK();
+}
+
+/* One byte from each bus into data[pin] */
+IRAM_ATTR void onewire_multi_read(uint32_t mask, uint8_t *data) {
+    uint32_t in[8];
+    int count, pin;
+
+    OW_BYTE_LOCK();
+    for (count = 0; count < 8; ++count)
+        in[count] = onewire_multi_read_bit(mask);
+    OW_BYTE_UNLOCK();
+
+    for (pin = 0; pin < OW_MULTI_PINS; pin++) {
+        if (!(mask & (1 << pin)))
+            continue;
+        data[pin] = 0;
+        for (count = 0; count < 8; ++count)
+            data[pin] |= ((in[count] >> pin) & 0x1) << count;
+    }
+}
+
+/*
+ * Start of command sequence: lock, reset and address device (rom NULL - SKIP ROM)
+ * On success caller must finish with onewire_unlock(), returns 1 if no device
+ */
+static int onewire_begin(const uint8_t *rom) {
+    onewire_lock();
+    if (onewire_reset()) {
+        onewire_unlock();
+        return 1;
+    }
+
+    if (rom)
+        onewire_select(rom);
+    else
+        onewire_write(0xCC);
+    return 0;
+}
+
+/*
+ * Whole command as one transaction: reset, MATCH ROM x->rom (or SKIP ROM),
+ * x->cmd, x->wlen bytes from x->wr, x->rlen bytes into x->rd. All slots go out
+ * in one schedule instead of byte by byte calls.
+ * Returns 0, -4 no device, -2 CRC mismatch (OW_XFER_CRC8), -1 too long
+ */
+int onewire_transaction(const onewire_xfer_t *x) {
+    uint8_t tx[OW_XFER_MAX], rx[OW_XFER_MAX];
+    int len = 0;
+
+    if ((x->rom ? 10 : 2) + x->wlen + x->rlen > OW_XFER_MAX)
+        return -1;
+    if (x->rom) {
+        tx[len++] = 0x55;
+        memcpy(&tx[len], x->rom, 8);
+        len += 8;
+    } else {
+        tx[len++] = 0xCC;
     }
+    tx[len++] = x->cmd;
+    if (x->wlen)
+        memcpy(&tx[len], x->wr, x->wlen);
+    len += x->wlen;
+    // Read slots are write 1 slots
+    memset(&tx[len], 0xFF, x->rlen);
+    len += x->rlen;
 
+    onewire_lock();
+    if (onewire_reset()) {
+        onewire_unlock();
+        return -4;
+    }
+    ow_slots(tx, rx, len, len - x->rlen);
+    onewire_unlock();
 
-    if (onewire_reset())
+    if (!x->rlen)
+        return 0;
+    memcpy(x->rd, &rx[len - x->rlen], x->rlen);
+    if ((x->flags & OW_XFER_CRC8) && crc8_data(x->rd, x->rlen - 1) != x->rd[x->rlen - 1])
+        return -2;
+    return 0;
+}
+
+/* Read and verify scratchpad, rom NULL means single device (SKIP ROM) */
+static int ds1820_scratchpad(const uint8_t *rom, uint8_t *data) {
+    onewire_xfer_t x = { .rom = rom, .cmd = 0xBE, .rd = data, .rlen = 9, .flags = OW_XFER_CRC8 };
+    uint8_t i;
+    int r;
+
+    r = onewire_transaction(&x);
+    if (r == -2) {
+        for (i = 0; i < 9; i++)
+            OW_PRINTF("data[%d]%02x ", i, data[i]);
+        OW_LOGE("ow", "CRC mismatch %02x %02x", data[8], crc8_data(data, 8));
+    }
+    return r;
+}
+
+/*
+ * Temperature in milli C from scratchpad, integer only (no soft float on
+ * ESP8266). Raw value is signed, in 1/16 C, so mC = raw * 1000 / 16
+ */
+static int32_t ds1820_temp(uint8_t type, uint8_t *data) {
+    int32_t raw = (int16_t)((data[1] << 8) | data[0]);
+
+    if (type == 0x10) {
+        /* 0.5C steps, full resolution by COUNT_REMAIN (COUNT_PER_C is 16):
+         * T = (raw >> 1) - 0.25 + (16 - remain) / 16 */
+        raw = ((raw >> 1) << 4) + 12 - data[6];
+    } else {
+        /* Ignore undefined low bits, depends on resolution */
+        raw &= ~((1 << (3 - ((data[4] >> 5) & 3))) - 1);
+    }
+    return (raw * 125) >> 1;
+}
+
+/*
+ * Conversion time by resolution (config byte bits 5-6), 93.75ms for 9 bit,
+ * doubling for each extra bit. Old DS1820 (0x10) is always 750ms
+ */
+#define DS1820_CONV_MS(cfg)     ( 94 << ((cfg) >> 5) )
+#define MS_TO_TICKS(ms)         ( ((ms) + portTICK_RATE_MS - 1) / portTICK_RATE_MS )
+
+/* Drive bus high for parasite devices converting or copying (not with UART) */
+static void onewire_strong_pullup(int on) {
+#ifndef OW_UART
+    if (on) {
+        OW_OUT_HIGH();
+        OW_DIR_OUT();
+    } else {
+        OW_DIR_IN();
+    }
+#endif
+}
+
+/* READ POWER SUPPLY, 1 - external power, 0 - parasite, -1 no device */
+int ds1820_powered(const uint8_t *rom) {
+    int r;
+
+    if (onewire_begin(rom))
+        return -1;
+
+    onewire_write(0xB4);
+    // Parasite powered devices pull bus low during read slot
+    r = onewire_read_bit();
+    onewire_unlock();
+    return (r);
+}
+
+/*
+ * Bus power gating: OW_PIN_POWER feeds sensors (VDD and pullup resistor), so
+ * bus can be powered only for acquisition. Power up waits OW_POWER_SETTLE_MS
+ * and checks for parasite powered devices by READ POWER SUPPLY.
+ * Returns as ds1820_powered(NULL): 1 all external, 0 some parasite, -1 no device
+ */
+/* Bus power cycles, cached single device profile is not trusted after one */
+static uint8_t ow_power_cycles;
+
+int onewire_power_up() {
+    ow_power_cycles++;
+    gpio_set_level(OW_PIN_POWER, 1);
+#ifndef OW_UART
+    OW_DIR_IN();
+#endif
+    vTaskDelay(MS_TO_TICKS(OW_POWER_SETTLE_MS));
+    return ds1820_powered(NULL);
+}
+
+/* Data line low too, so devices are not fed through it */
+void onewire_power_down() {
+    gpio_set_level(OW_PIN_POWER, 0);
+#ifndef OW_UART
+    OW_OUT_LOW();
+    OW_DIR_OUT();
+#endif
+}
+
+/*
+ * Cold bus between wakeups. After deep sleep chip starts from reset and GPIO
+ * are inputs, so power switch needs pulldown (to be off) until next power up.
+ */
+void onewire_deep_sleep(uint64_t us) {
+    onewire_power_down();
+    esp_deep_sleep(us);
+}
+
+/*
+ * Issue CONVERT T and return without waiting, c->rom NULL converts all devices
+ * c->cfg should hold last known config byte (0x60 if unknown, worst case)
+ * c->powered 1 if device is known to be externally powered
+ */
+int ds1820_start(ds1820_conv_t *c) {
+    uint8_t cfg = c->cfg & 0x60;
+
+    if (onewire_begin(c->rom)) {
+        c->state = DS1820_ERROR;
         return -3;
+    }
 
-    onewire_write(0xCC);
     onewire_write(0x44);
+    // Parasite devices take conversion current from bus
+    if (!c->powered)
+        onewire_strong_pullup(1);
+    onewire_unlock();
+
+    if (c->family == 0x10)
+        cfg = 0x60;
+    c->wait = MS_TO_TICKS(DS1820_CONV_MS(cfg));
+    c->start = xTaskGetTickCount();
+    c->state = DS1820_CONVERTING;
+    return 0;
+}
+
+/*
+ * Check if conversion finished, never blocks. Externally powered devices answer
+ * read slots with 0 while converting, so we can finish early, for parasite power
+ * just wait for time by datasheet. Bus must not be used until conversion done.
+ */
+int ds1820_poll(ds1820_conv_t *c) {
+    int done = 0;
+
+    if (c->state != DS1820_CONVERTING)
+        return c->state;
+
+    if (c->powered) {
+        onewire_lock();
+        done = onewire_read_bit();
+        onewire_unlock();
+    }
+
+    if (done)
+        c->state = DS1820_READY;
+    else if ((TickType_t)(xTaskGetTickCount() - c->start) >= c->wait)
+        c->state = DS1820_READY;
+
+    if (c->state == DS1820_READY && !c->powered)
+        onewire_strong_pullup(0);
+    return c->state;
+}
+
+/* Block calling task until conversion finished */
+int ds1820_wait(ds1820_conv_t *c) {
+    TickType_t spent;
+
+    while (ds1820_poll(c) == DS1820_CONVERTING) {
+        spent = xTaskGetTickCount() - c->start;
+        if (c->powered || spent >= c->wait)
+            vTaskDelay(1);
+        else
+            vTaskDelay(c->wait - spent);
+    }
+    return c->state;
+}
+
+/* Read result of finished conversion, remembers resolution for next start */
+int ds1820_complete(ds1820_conv_t *c, int32_t *temp) {
+    uint8_t data[9];
+    int r;
+
+    if (c->state != DS1820_READY)
+        return -3;
+
+    c->state = DS1820_IDLE;
+    r = ds1820_scratchpad(c->rom, data);
+    if (r) {
+        c->state = DS1820_ERROR;
+        return r;
+    }
+
+    c->cfg = data[4] & 0x60;
+    *temp = ds1820_temp(c->rom ? c->rom[0] : c->family, data);
+    return 0;
+}
 
-    // Conversion delay
-    vTaskDelay(1000 / portTICK_RATE_MS);
+/*
+ * WRITE SCRATCHPAD: TH, TL and config (DS18B20 only), optionally COPY
+ * SCRATCHPAD to EEPROM, so values survive power loss
+ */
+static int ds1820_write_scratchpad(const uint8_t *rom, uint8_t family, uint8_t th, uint8_t tl,
+                                   uint8_t cfg, int save) {
+    uint8_t wr[3] = { th, tl, cfg };
+    onewire_xfer_t x = { .rom = rom, .cmd = 0x4E, .wr = wr, .wlen = (family == 0x10) ? 2 : 3 };
 
-    if (onewire_reset())
+    if (onewire_transaction(&x))
         return -4;
 
-    onewire_write(0xCC);
-    onewire_write(0xBE);
+    if (save) {
+        if (onewire_begin(rom))
+            return -4;
+        onewire_write(0x48);
+        onewire_strong_pullup(1);
+        onewire_unlock();
+        // EEPROM write, 10ms max
+        vTaskDelay(MS_TO_TICKS(10) + 1);
+        onewire_strong_pullup(0);
+    }
+    return 0;
+}
+
+/*
+ * Alarm thresholds of device, in whole C. After each conversion device sets
+ * alarm flag if T >= TH or T <= TL, ALARM SEARCH then finds only such devices.
+ * Resolution is kept, values are checked by reading scratchpad back.
+ */
+int ds1820_set_alarm(const uint8_t *rom, int8_t th, int8_t tl, int save) {
+    uint8_t data[9];
+    int r;
+
+    r = ds1820_scratchpad(rom, data);
+    if (r)
+        return r;
+    r = ds1820_write_scratchpad(rom, rom[0], th, tl, data[4], save);
+    if (r)
+        return r;
+    r = ds1820_scratchpad(rom, data);
+    if (r)
+        return r;
+    if ((int8_t)data[2] != th || (int8_t)data[3] != tl)
+        return -2;
+    return 0;
+}
+
+static void ds1820_invalidate(ds1820_dev_t *dev) {
+    dev->valid = 0;
+    dev->verified = 0;
+}
+
+/*
+ * Learn power mode and resolution of device (dev->rom), so reads don't have
+ * to ask each time. Done once at discovery, again after profile is invalidated
+ */
+int ds1820_profile(ds1820_dev_t *dev) {
+    uint8_t data[9];
+    int r;
+
+    ds1820_invalidate(dev);
+    r = ds1820_powered(dev->rom);
+    if (r < 0)
+        return -1;
+    dev->powered = r;
+
+    r = ds1820_scratchpad(dev->rom, data);
+    if (r)
+        return r;
+    dev->cfg = dev->rom[0] == 0x10 ? 0x60 : data[4] & 0x60;
+    dev->valid = 1;
+    return 0;
+}
+
+/*
+ * Read result of one device by MATCH ROM, after broadcast conversion finished
+ * Result in dev->status (same codes as ds1820_read) and dev->temp
+ */
+int ds1820_fetch(ds1820_dev_t *dev) {
+    uint8_t data[9];
+
+    dev->status = ds1820_scratchpad(dev->rom, data);
+    if (dev->status) {
+        ds1820_invalidate(dev);
+        return dev->status;
+    }
+    if (dev->rom[0] != 0x10)
+        dev->cfg = data[4] & 0x60;
+    dev->temp = ds1820_temp(dev->rom[0], data);
+    return 0;
+}
+
+/*
+ * Broadcast conversion of devs: wait and polling by slowest/parasite device,
+ * from profiles (learned here if not yet). Without known devices worst case
+ * resolution, power mode asked from bus.
+ */
+static void ds1820_conv_setup(ds1820_conv_t *conv, ds1820_dev_t *devs, int count) {
+    int i;
+
+    conv->rom = NULL;
+    conv->cfg = 0;
+    conv->powered = 1;
+    if (!count) {
+        conv->cfg = 0x60;
+        conv->powered = (ds1820_powered(NULL) == 1);
+        return;
+    }
+    for (i = 0; i < count; i++) {
+        if (!devs[i].valid)
+            ds1820_profile(&devs[i]);
+        if (!devs[i].valid) {
+            conv->cfg = 0x60;
+            conv->powered = 0;
+        } else {
+            if (devs[i].cfg > conv->cfg)
+                conv->cfg = devs[i].cfg;
+            conv->powered &= devs[i].powered;
+        }
+    }
+}
+
+/*
+ * Read all devices on bus at once: one broadcast CONVERT T, single conversion
+ * delay, then each scratchpad by MATCH ROM. ROMs usually from onewire_search_all()
+ * devs should be zeroed before first call, profiles are filled on first sweep
+ * Per device result in devs[i].status (same codes as ds1820_read)
+ * Returns number of devices read successfully, -1 if bus is empty
+ */
+int ds1820_sweep(ds1820_dev_t *devs, int count) {
+    ds1820_conv_t conv = { .rom = NULL };
+    int i, ok = 0;
+
+    ds1820_conv_setup(&conv, devs, count);
+    if (ds1820_start(&conv))
+        return -1;
+
+    // Conversion delay, once for all devices
+    ds1820_wait(&conv);
+
+    for (i = 0; i < count; i++) {
+        if (!ds1820_fetch(&devs[i]))
+            ok++;
+    }
+    return ok;
+}
+
+/*
+ * Event mode: one broadcast CONVERT T, then ALARM SEARCH, so only devices out
+ * of their TH/TL (ds1820_set_alarm()) are returned in roms. Returns number of
+ * such devices, -1 if bus is empty. Read them with ds1820_fetch() if needed.
+ * devs are devices known on bus (as for ds1820_sweep()), conversion wait is
+ * by slowest of them, with count 0 it is 750ms.
+ */
+int ds1820_alarm_scan(ds1820_dev_t *devs, int count, uint8_t (*roms)[8], int max) {
+    ds1820_conv_t conv = { .rom = NULL };
+
+    ds1820_conv_setup(&conv, devs, count);
+    if (ds1820_start(&conv))
+        return -1;
+    ds1820_wait(&conv);
+
+    return onewire_alarm_search_all(roms, max);
+}
+
+/*
+ * Read one device on each bus in mask, all buses in parallel. Results in
+ * temp[pin] (milli C) and status[pin] (same codes as ds1820_read), arrays of
+ * OW_MULTI_PINS. Returns mask of buses read successfully. Needs about 300
+ * bytes of stack for ROM and scratchpad bytes of all buses.
+ */
+uint32_t ds1820_multi_read(uint32_t mask, int32_t *temp, int *status) {
+    uint8_t rom[8][OW_MULTI_PINS], data[9][OW_MULTI_PINS];
+    uint8_t buf[9], cfg, slowest = 0;
+    uint32_t ok;
+    int i, pin;
+
+    // GPIO16 is not in GPIO.in/out registers
+    mask &= (1 << OW_MULTI_PINS) - 1;
+    for (pin = 0; pin < OW_MULTI_PINS; pin++) {
+        if (mask & (1 << pin))
+            status[pin] = -1;
+    }
+
+    ok = onewire_multi_reset(mask);
+    if (!ok)
+        return 0;
+
+    // Read ROM, for type
+    onewire_lock();
+    onewire_multi_write(ok, 0x33);
+    for (i = 0; i < 8; i++)
+        onewire_multi_read(ok, rom[i]);
+    onewire_unlock();
+
+    // Resolution of each device, for conversion delay
+    onewire_lock();
+    ok = onewire_multi_reset(ok);
+    onewire_multi_write(ok, 0xCC);
+    onewire_multi_write(ok, 0xBE);
     for (i = 0; i < 9; i++)
-        data[i] = onewire_read();
+        onewire_multi_read(ok, data[i]);
+    onewire_unlock();
+
+    for (pin = 0; pin < OW_MULTI_PINS; pin++) {
+        if (!(ok & (1 << pin)))
+            continue;
+        for (i = 0; i < 9; i++)
+            buf[i] = data[i][pin];
+        // DS18S20 is always 750ms, unknown config as slowest too
+        if (rom[0][pin] == 0x10 || crc8_data(buf, 8) != buf[8])
+            cfg = 0x60;
+        else
+            cfg = buf[4] & 0x60;
+        if (cfg > slowest)
+            slowest = cfg;
+    }
+
+    onewire_lock();
+    ok = onewire_multi_reset(ok);
+    onewire_multi_write(ok, 0xCC);
+    onewire_multi_write(ok, 0x44);
+    onewire_unlock();
 
-    crc8 = crc8_data(data, 8);
+    // Conversion delay, once for all buses, by slowest device
+    vTaskDelay(MS_TO_TICKS(DS1820_CONV_MS(slowest)));
 
-    if (crc8 != data[8]) {
+    onewire_lock();
+    ok = onewire_multi_reset(ok);
+    onewire_multi_write(ok, 0xCC);
+    onewire_multi_write(ok, 0xBE);
+    for (i = 0; i < 9; i++)
+        onewire_multi_read(ok, data[i]);
+    onewire_unlock();
+
+    for (pin = 0; pin < OW_MULTI_PINS; pin++) {
+        if (!(ok & (1 << pin)))
+            continue;
+        for (i = 0; i < 8; i++)
+            buf[i] = rom[i][pin];
+        if (crc8_data(buf, 7) != buf[7]) {
+            status[pin] = -5;
+            ok &= ~(1 << pin);
+            continue;
+        }
         for (i = 0; i < 9; i++)
-            printf("data[%d]%02x ", i, data[i]);
-        ESP_LOGE("ow", "CRC mismatch %02x %02x", data[8], crc8);
-        return -2;
+            buf[i] = data[i][pin];
+        if (crc8_data(buf, 8) != buf[8]) {
+            status[pin] = -2;
+            ok &= ~(1 << pin);
+            continue;
+        }
+        temp[pin] = ds1820_temp(rom[0][pin], buf);
+        status[pin] = 0;
     }
+    return ok;
+}
 
-    
+/* Single device on bus, temperature in milli C */
+int ds1820_read_mc(int32_t *temp) {
+    static ds1820_dev_t dev;
+    static uint8_t power_cycle;
+    ds1820_conv_t conv = { .rom = NULL };
+    uint8_t i = 0;
+    uint8_t crc8 = 0xFF;
+    int r;
 
-    if (type == 0x10) {
-        //printf(" OLD TYPE\r\n");
-        *temp = (double)(data[0] >> 1);
-        double count_per_c = 0x10;
-        double count_remain = data[6];
-        *temp = *temp - 0.25 + ((count_per_c - count_remain) / count_per_c);
-    } else {
-        double minus = 1.0;
-        if (data[1] & 0x80)
-            minus = -1.0;
-
-        uint8_t cfg = (data[4] & 0x60);
-        uint8_t mask = 0xFF;
-        
-        /* Ignore some bits depends on precision */
-        if (cfg == 0x00)
-            mask = 0xF8;        
-        else if (cfg == 0x20) 
-            mask = 0xFC;
-        else if (cfg == 0x40)
-            mask = 0xFE;
-        
-        raw = (data[1] << 8) | (data[0] & mask);
-
-        /* If minus... */
-        if (minus == -1.0)
-            raw = 0xFFFF - raw;
-        *temp = (double)raw * 0.0625 * minus;
-
-        /* Increase resolution */
-        if (cfg != 0x60) {
-            printf("Fixing resolution\r\n");
-            onewire_reset();
-            onewire_write(0xCC);
-            onewire_write(0x4E);
-            onewire_write(0x0);//alarm
-            onewire_write(0x0);//alarm
-            onewire_write(0x7F);
-            onewire_reset();
-            vTaskDelay(30 / portTICK_RATE_MS);
-            onewire_write(0xCC);
-            onewire_write(0x48); // save to eeprom
-            vTaskDelay(30 / portTICK_RATE_MS);
+    /* Bus was unpowered, device there might be other one or fed other way */
+    if (power_cycle != ow_power_cycles) {
+        power_cycle = ow_power_cycles;
+        ds1820_invalidate(&dev);
+    }
+
+    /*
+     * Single device, profile (type, power, resolution) is learned on first read
+     * and kept until device is lost, so steady state read is convert and
+     * scratchpad only
+     */
+    if (!dev.valid) {
+        // Read ROM (and important - type), reset in same locked transaction
+        onewire_lock();
+        if (onewire_reset()) {
+            onewire_unlock();
+            return -1; // Device not found
         }
+        onewire_write(0x33);
+        for (i = 0; i < 8; i++)
+            dev.rom[i] = onewire_read();
+        onewire_unlock();
+
+        crc8 = crc8_data(dev.rom, 7);
+        if (crc8 != dev.rom[7]) {
+            for (i = 0; i < 8; i++)
+                OW_PRINTF("rom[%d]%02x ", i, dev.rom[i]);
+            OW_PRINTF("\r\n");
+
+            OW_PRINTF("ROM CRC error\r\n");
+            return -5;
+        }
+
+        r = ds1820_profile(&dev);
+        if (r)
+            return r;
+    }
+
+    conv.family = dev.rom[0];
+    conv.cfg = dev.cfg;
+    conv.powered = dev.powered;
+    if (ds1820_start(&conv)) {
+        ds1820_invalidate(&dev);
+        return -1;
+    }
 
+    // Conversion delay, by resolution seen last time
+    ds1820_wait(&conv);
+
+    r = ds1820_complete(&conv, temp);
+    if (r) {
+        ds1820_invalidate(&dev);
+        return r;
+    }
+    dev.cfg = conv.cfg;
+
+    /* Increase resolution, EEPROM is written once per device, not each read */
+    if (dev.rom[0] != 0x10 && !dev.verified) {
+        if (dev.cfg != 0x60) {
+            uint8_t data[9];
+
+            OW_PRINTF("Fixing resolution\r\n");
+            // Keep alarm thresholds (TH, TL) as they are
+            r = ds1820_scratchpad(NULL, data);
+            if (!r)
+                r = ds1820_write_scratchpad(NULL, dev.rom[0], data[2], data[3], 0x7F, 1);
+            if (r) {
+                ds1820_invalidate(&dev);
+                return 0;
+            }
+            dev.cfg = 0x60;
+        }
+        dev.verified = 1;
     }
 
     return 0;
 }
+
+/* Same in C, for old callers */
+int ds1820_read(double *temp) {
+    int32_t mc;
+    int r;
+
+    r = ds1820_read_mc(&mc);
+    if (!r)
+        *temp = mc / 1000.0;
+    return r;
+}
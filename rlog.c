@@ -0,0 +1,260 @@
+/*
+ * Copyright (C) 2017, Denys Fedoryshchenko
+ * Contact: <nuclearcat@nuclearcat.com>
+ * Licensed under the GPLv2
+ * <http://www.gnu.org/licenses/old-licenses/gpl-2.0.txt>
+ *
+ * Store and forward log of readings, so node can sample often and bring up
+ * WiFi only to upload many readings at once.
+ * Readings are appended to RTC user memory (survives deep sleep), each
+ * RLOG_RTC of them are written to ring of RLOG_SECTORS flash sectors with one
+ * flash write. Place of record in flash is given by its sequence number, so
+ * sectors are erased in turn (even wear) and on cold boot head is found by
+ * reading first record of each sector and binary search in newest one.
+ * Records have CRC32, torn or bad ones are skipped when read.
+ *
+ * rlog_init(LOG_SEC);
+ * rlog_append(&reading);
+ * if (rlog_pending() >= 60) {
+ *  pos = rlog_tail();
+ *  n = rlog_read(&pos, r, 16);
+ *  ... encode (tlm_add()) and upload ...
+ *  rlog_ack(pos);
+ * }
+ * system_deep_sleep(60000000);
+ *
+ * Upload position is kept in RTC and marked in flash on last uploaded record,
+ * so after power loss only readings still in RTC memory are lost.
+ * Uses crc32_update() from ota.c.
+ */
+#ifdef HAL_LINUX
+#include "hal.h"
+#else
+#include "esp_common.h"
+#endif
+#include <stddef.h>
+#include "esp8266stuff.h"
+
+#ifndef RLOG_RTC
+#define RLOG_RTC        12      /* readings in RTC memory before flash write */
+#endif
+#ifndef RLOG_SECTORS
+#define RLOG_SECTORS    8
+#endif
+
+#define RLOG_MAGIC      0x524C4701
+#define RLOG_RTC_ADDR   64      /* first user block of RTC memory */
+
+typedef struct {
+        uint32_t seq;
+        uint32_t time;
+        uint32_t id[2];
+        int32_t temp;
+        int32_t hum;
+        uint32_t crc;           /* of fields above */
+        uint32_t sent;          /* cleared in place on last uploaded record */
+} rlog_rec_t;
+
+#define PER_SEC         ( SPI_FLASH_SEC_SIZE / sizeof(rlog_rec_t) )
+
+/* Whole state is in RTC user memory (512 bytes) */
+typedef struct {
+        uint32_t magic;
+        uint32_t seq;           /* next record */
+        uint32_t acked;         /* first record not uploaded */
+        uint32_t count;         /* last records, still in rec[] */
+        rlog_rec_t rec[RLOG_RTC];
+        uint32_t crc;
+} rlog_state_t;
+
+static rlog_state_t st;
+static uint16_t base;
+
+static uint32_t rec_crc(const rlog_rec_t *rec) {
+        return(crc32_update(0, (const uint8_t *)rec, offsetof(rlog_rec_t, crc)));
+}
+
+static uint32_t rec_addr(uint32_t seq) {
+        return((base + (seq / PER_SEC) % RLOG_SECTORS) * SPI_FLASH_SEC_SIZE +
+               (seq % PER_SEC) * sizeof(rlog_rec_t));
+}
+
+/* Record seq from flash, 0 if it is there and intact */
+static int rec_load(uint32_t seq, rlog_rec_t *rec) {
+        if (spi_flash_read(rec_addr(seq), (uint32_t *)rec, sizeof(*rec)) != SPI_FLASH_RESULT_OK)
+                return(-1);
+        if (rec->seq != seq || rec->crc != rec_crc(rec))
+                return(-1);
+        return(0);
+}
+
+/* Oldest record still in flash, sector to be erased next doesn't count */
+static uint32_t rlog_oldest(void) {
+        uint32_t next = st.seq - st.count;
+        uint32_t sec = next - next % PER_SEC;
+
+        if (sec < (RLOG_SECTORS - 1) * PER_SEC)
+                return(0);
+        return(sec - (RLOG_SECTORS - 1) * PER_SEC);
+}
+
+static void rlog_save(void) {
+        st.crc = crc32_update(0, (const uint8_t *)&st, offsetof(rlog_state_t, crc));
+        system_rtc_mem_write(RLOG_RTC_ADDR, &st, sizeof(st));
+}
+
+/* Cold boot, RTC memory is lost, find head and upload mark in flash */
+static void rlog_recover(void) {
+        rlog_rec_t rec;
+        uint32_t first = 0, lo, hi, mid, seq, oldest;
+        int i, found = 0;
+
+        memset(&st, 0, sizeof(st));
+        st.magic = RLOG_MAGIC;
+
+        /* Newest sector has highest sequence in its first record */
+        for (i = 0; i < RLOG_SECTORS; i++) {
+                if (spi_flash_read((base + i) * SPI_FLASH_SEC_SIZE, (uint32_t *)&rec, sizeof(rec)) != SPI_FLASH_RESULT_OK)
+                        continue;
+                if (rec.crc != rec_crc(&rec) || rec.seq % PER_SEC ||
+                    (rec.seq / PER_SEC) % RLOG_SECTORS != (uint32_t)i)
+                        continue;
+                if (!found || rec.seq > first)
+                        first = rec.seq;
+                found = 1;
+        }
+        if (!found)
+                return;
+
+        /* Records are written in order, first erased one is head */
+        lo = 1;
+        hi = PER_SEC;
+        while (lo < hi) {
+                mid = (lo + hi) / 2;
+                if (spi_flash_read(rec_addr(first + mid), &seq, 4) != SPI_FLASH_RESULT_OK)
+                        break;
+                if (seq == 0xFFFFFFFF)
+                        hi = mid;
+                else
+                        lo = mid + 1;
+        }
+        st.seq = first + lo;
+
+        oldest = rlog_oldest();
+        st.acked = oldest;
+        for (seq = st.seq; seq-- > oldest;) {
+                if (!rec_load(seq, &rec) && !rec.sent) {
+                        st.acked = seq + 1;
+                        break;
+                }
+        }
+}
+
+/* Returns number of readings waiting for upload */
+int rlog_init(uint16_t sec) {
+        base = sec;
+        if (!system_rtc_mem_read(RLOG_RTC_ADDR, &st, sizeof(st)) || st.magic != RLOG_MAGIC ||
+            st.crc != crc32_update(0, (const uint8_t *)&st, offsetof(rlog_state_t, crc)))
+                rlog_recover();
+        rlog_save();
+        return(rlog_pending());
+}
+
+/* Write readings from RTC memory to flash, returns 0 on success */
+int rlog_flush(void) {
+        uint32_t seq, n, i = 0;
+
+        while (i < st.count) {
+                seq = st.rec[i].seq;
+                if (!(seq % PER_SEC) &&
+                    spi_flash_erase_sector(base + (seq / PER_SEC) % RLOG_SECTORS) != SPI_FLASH_RESULT_OK)
+                        return(-1);
+                /* Up to end of sector in one write */
+                n = PER_SEC - seq % PER_SEC;
+                if (n > st.count - i)
+                        n = st.count - i;
+                if (spi_flash_write(rec_addr(seq), (uint32_t *)&st.rec[i], n * sizeof(rlog_rec_t)) != SPI_FLASH_RESULT_OK)
+                        return(-1);
+                i += n;
+        }
+        st.count = 0;
+        /* Ring wrapped over readings that were never uploaded */
+        if ((int32_t)(st.acked - rlog_oldest()) < 0)
+                st.acked = rlog_oldest();
+        rlog_save();
+        return(0);
+}
+
+/* Returns 0, or -1 if RTC memory is full and flash write failed */
+int rlog_append(const tlm_reading_t *r) {
+        rlog_rec_t *rec;
+
+        if (st.count == RLOG_RTC && rlog_flush())
+                return(-1);
+        rec = &st.rec[st.count++];
+        rec->seq = st.seq++;
+        rec->time = r->time;
+        rec->id[0] = r->id;
+        rec->id[1] = r->id >> 32;
+        rec->temp = r->temp;
+        rec->hum = r->hum;
+        rec->crc = rec_crc(rec);
+        rec->sent = 0xFFFFFFFF;
+        rlog_save();
+        return(0);
+}
+
+int rlog_pending(void) {
+        return(st.seq - st.acked);
+}
+
+/* Position of oldest reading not uploaded, for rlog_read() */
+uint32_t rlog_tail(void) {
+        return(st.acked);
+}
+
+/* Up to max readings from *pos, moves *pos past them, returns count */
+int rlog_read(uint32_t *pos, tlm_reading_t *r, int max) {
+        uint32_t next = st.seq - st.count;
+        rlog_rec_t rec;
+        int n = 0;
+
+        if ((int32_t)(*pos - rlog_oldest()) < 0)
+                *pos = rlog_oldest();
+        while (n < max && *pos != st.seq) {
+                if (*pos >= next)
+                        rec = st.rec[*pos - next];
+                else if (rec_load(*pos, &rec)) {
+                        /* Torn or worn record, skip it */
+                        (*pos)++;
+                        continue;
+                }
+                r[n].id = (uint64_t)rec.id[1] << 32 | rec.id[0];
+                r[n].time = rec.time;
+                r[n].temp = rec.temp;
+                r[n].hum = rec.hum;
+                n++;
+                (*pos)++;
+        }
+        return(n);
+}
+
+/* Everything before pos is uploaded, returns 0 on success */
+int rlog_ack(uint32_t pos) {
+        uint32_t next = st.seq - st.count, zero = 0;
+
+        int ret = 0;
+
+        if ((int32_t)(pos - st.seq) > 0)
+                return(-1);
+        if ((int32_t)(pos - st.acked) <= 0)
+                return(0);
+        st.acked = pos;
+        /* Mark for cold boot, clearing bits needs no erase */
+        if (pos - 1 >= next)
+                st.rec[pos - 1 - next].sent = 0;
+        else if (spi_flash_write(rec_addr(pos - 1) + offsetof(rlog_rec_t, sent), &zero, 4) != SPI_FLASH_RESULT_OK)
+                ret = -1;
+        rlog_save();
+        return(ret);
+}
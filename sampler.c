@@ -0,0 +1,212 @@
+/*
+ * Copyright (C) 2017, Denys Fedoryshchenko
+ * Contact: <nuclearcat@nuclearcat.com>
+ * Licensed under the GPLv2
+ * <http://www.gnu.org/licenses/old-licenses/gpl-2.0.txt>
+ *
+ * Background sampling of DHT and DS1820 sensors. One task owns sensors and
+ * buses, reads each sensor not more often than its interval (and never faster
+ * than device allows), and keeps last values in cache, so application gets
+ * them in microseconds by sampler_get().
+ *
+ * Bus time is packed: if DS1820 devices are due, broadcast CONVERT T is issued
+ * first and DHT sensors (all due pins at once, dht_read_multi()) are read
+ * while conversion runs, then each DS1820 scratchpad is read by MATCH ROM.
+ *
+ * id = sampler_add_ds1820(rom, 10000);
+ * sampler_add_dht(4, 2000);
+ * sampler_start();
+ * ...
+ * if (!sampler_get(id, &v)) ... v.temp, v.time
+ *
+ * Without task (and with HAL_LINUX) call sampler_step() yourself, it returns
+ * ticks until next sensor is due.
+ */
+#ifdef HAL_LINUX
+#include "hal.h"
+#else
+#include "esp_common.h"
+#endif
+#include "esp8266stuff.h"
+
+/* AM2320 datasheet, not more often than each 2s */
+#define DHT_MIN_MS      2000
+/* DS1820 conversion at 12 bit */
+#define DS1820_MIN_MS   750
+
+#define MS_TO_TICKS(ms) ( ((ms) + portTICK_RATE_MS - 1) / portTICK_RATE_MS )
+
+typedef struct {
+        uint8_t type;
+        uint8_t pin;
+        ds1820_dev_t dev;       /* ROM and profile */
+        uint32_t interval;      /* ticks */
+        uint32_t next;          /* tick when due */
+        sampler_value_t value;
+} sampler_t;
+
+static sampler_t sensors[SAMPLER_MAX];
+static int nsensors;
+
+static int sampler_add(uint8_t type, uint32_t interval_ms, uint32_t min_ms) {
+        sampler_t *s;
+
+        if (nsensors == SAMPLER_MAX)
+                return(-1);
+        s = &sensors[nsensors];
+        memset(s, 0, sizeof(*s));
+        s->type = type;
+        s->interval = MS_TO_TICKS(interval_ms < min_ms ? min_ms : interval_ms);
+        s->next = xTaskGetTickCount();
+        s->value.status = -1;
+        return(nsensors++);
+}
+
+/* Sensor on its own pin (GPIO0-15), returns id or -1 */
+int sampler_add_dht(int pin, uint32_t interval_ms) {
+        int id;
+
+        if (pin < 0 || pin > 15)
+                return(-1);
+        id = sampler_add(SAMPLER_DHT, interval_ms, DHT_MIN_MS);
+        if (id >= 0)
+                sensors[id].pin = pin;
+        return(id);
+}
+
+/* Device on ow.c bus by ROM code, returns id or -1 */
+int sampler_add_ds1820(const uint8_t *rom, uint32_t interval_ms) {
+        int id;
+
+        id = sampler_add(SAMPLER_DS1820, interval_ms, DS1820_MIN_MS);
+        if (id >= 0)
+                memcpy(sensors[id].dev.rom, rom, 8);
+        return(id);
+}
+
+/* Short critical section, task might be preempted by reader or other way */
+static void sampler_publish(sampler_t *s, sampler_value_t *v) {
+        portENTER_CRITICAL();
+        s->value = *v;
+        portEXIT_CRITICAL();
+}
+
+/* Read all due sensors once, returns ticks until next one is due */
+uint32_t sampler_step(void) {
+        ds1820_conv_t conv = { .rom = NULL, .cfg = 0 };
+        sampler_value_t v;
+        int32_t temp[16], hum[16];
+        int status[16];
+        uint32_t now = xTaskGetTickCount();
+        uint32_t dht = 0, wait = 0xFFFFFFFF;
+        int i, ds = 0;
+
+        for (i = 0; i < nsensors; i++) {
+                if ((int32_t)(now - sensors[i].next) < 0)
+                        continue;
+                if (sensors[i].type == SAMPLER_DHT)
+                        dht |= 1 << sensors[i].pin;
+                else
+                        ds++;
+        }
+
+        /*
+         * Start conversion first, DHT is read while it runs. Broadcast
+         * converts every device on bus, so wait and polling are by slowest or
+         * parasite one, from profiles learned once per device
+         */
+        if (ds) {
+                conv.powered = 1;
+                for (i = 0; i < nsensors; i++) {
+                        ds1820_dev_t *dev = &sensors[i].dev;
+
+                        if (sensors[i].type != SAMPLER_DS1820)
+                                continue;
+                        if (!dev->valid)
+                                ds1820_profile(dev);
+                        if (!dev->valid) {
+                                conv.cfg = 0x60;
+                                conv.powered = 0;
+                        } else {
+                                if (dev->cfg > conv.cfg)
+                                        conv.cfg = dev->cfg;
+                                conv.powered &= dev->powered;
+                        }
+                }
+                if (ds1820_start(&conv))
+                        ds = -1;
+        }
+
+        if (dht)
+                dht_read_multi(dht, temp, hum, status);
+
+        if (ds > 0)
+                ds1820_wait(&conv);
+
+        for (i = 0; i < nsensors; i++) {
+                sampler_t *s = &sensors[i];
+
+                if ((int32_t)(now - s->next) < 0)
+                        continue;
+                memset(&v, 0, sizeof(v));
+                if (s->type == SAMPLER_DHT) {
+                        v.status = status[s->pin];
+                        v.temp = temp[s->pin];
+                        v.hum = hum[s->pin];
+                } else if (ds < 0) {
+                        /* Learn profile again, device might be replaced */
+                        s->dev.valid = 0;
+                        v.status = -3;
+                } else {
+                        /* Drops profile on error */
+                        v.status = ds1820_fetch(&s->dev);
+                        v.temp = s->dev.temp;
+                }
+                v.time = xTaskGetTickCount();
+                /* Keep last good value on error, only status changes */
+                if (v.status) {
+                        v.temp = s->value.temp;
+                        v.hum = s->value.hum;
+                        v.time = s->value.time;
+                }
+                sampler_publish(s, &v);
+                s->next = now + s->interval;
+        }
+
+        now = xTaskGetTickCount();
+        for (i = 0; i < nsensors; i++) {
+                if ((int32_t)(sensors[i].next - now) <= 0)
+                        return(0);
+                if (sensors[i].next - now < wait)
+                        wait = sensors[i].next - now;
+        }
+        return(wait);
+}
+
+#ifndef HAL_LINUX
+static void sampler_task(void *arg) {
+        uint32_t wait;
+
+        for (;;) {
+                wait = sampler_step();
+                vTaskDelay(wait ? wait : 1);
+        }
+}
+
+/* Start task after all sensors are added */
+int sampler_start(void) {
+        if (xTaskCreate(sampler_task, (const signed char *)"sampler", 512, NULL, 2, NULL) != pdPASS)
+                return(-1);
+        return(0);
+}
+#endif
+
+/* Copy of last sample, returns its status */
+int sampler_get(int id, sampler_value_t *v) {
+        if (id < 0 || id >= nsensors)
+                return(-1);
+        portENTER_CRITICAL();
+        *v = sensors[id].value;
+        portEXIT_CRITICAL();
+        return(v->status);
+}
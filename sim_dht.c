@@ -0,0 +1,131 @@
+/*
+ * Copyright (C) 2017, Denys Fedoryshchenko
+ * Contact: <nuclearcat@nuclearcat.com>
+ * Licensed under the GPLv2
+ * <http://www.gnu.org/licenses/old-licenses/gpl-2.0.txt>
+ *
+ * Simulated DHT11/DHT22/AM2320 for hal_linux.c
+ * After master holds line low long enough (Tbe) and releases it, sensor sends
+ * response and 40 bit frame with typical timings from datasheet, scaled by
+ * sensor clock and with random jitter if sim_dht_timing() says so.
+ */
+#include <stdlib.h>
+#include "hal.h"
+
+#define DHT_EDGES   84  /* Trel, Treh, 2 per bit, final low and release */
+
+typedef struct {
+    sim_dev_t dev;
+    int type;
+    int temp;           /* tenths of C */
+    int hum;            /* tenths of % */
+    int clock;          /* sensor clock, % of nominal */
+    int jitter;         /* us, each phase +-jitter */
+    uint32_t rng;
+    uint64_t fall;
+    int active;
+    uint64_t edge[DHT_EDGES];
+} sim_dht_t;
+
+static void frame(sim_dht_t *s, uint8_t *data) {
+    int t = s->temp < 0 ? -s->temp : s->temp;
+
+    if (s->type == 11) {
+        data[0] = s->hum / 10;
+        data[1] = 0;
+        data[2] = t / 10;
+        data[3] = 0;
+    } else {
+        data[0] = s->hum >> 8;
+        data[1] = s->hum & 0xFF;
+        data[2] = (t >> 8) | (s->temp < 0 ? 0x80 : 0);
+        data[3] = t & 0xFF;
+    }
+    data[4] = data[0] + data[1] + data[2] + data[3];
+}
+
+/* Phase of nominal us as sensor times it */
+static uint64_t phase(sim_dht_t *s, int us) {
+    int64_t c = HAL_US(us) * 100 / s->clock;
+
+    if (s->jitter) {
+        s->rng = s->rng * 1103515245 + 12345;
+        c += ((int)((s->rng >> 16) % (2 * s->jitter + 1)) - s->jitter) * HAL_CPU_MHZ;
+    }
+    return c;
+}
+
+static void dht_edge(sim_dev_t *d, int level, uint64_t t) {
+    sim_dht_t *s = (sim_dht_t *)d;
+    uint64_t min = s->type == 11 ? HAL_US(18000) : HAL_US(800);
+    uint8_t data[5];
+    int i, n = 0;
+
+    if (!level) {
+        s->fall = t;
+        s->active = 0;
+        return;
+    }
+    if (t - s->fall < min)
+        return;
+
+    /* Tgo, Trel, Treh */
+    frame(s, data);
+    t += phase(s, 30);
+    s->edge[n++] = t;
+    t += phase(s, 80);
+    s->edge[n++] = t;
+    t += phase(s, 80);
+    for (i = 0; i < 40; i++) {
+        s->edge[n++] = t;
+        t += phase(s, 50);
+        s->edge[n++] = t;
+        t += phase(s, (data[i / 8] & (0x80 >> (i % 8))) ? 70 : 26);
+    }
+    s->edge[n++] = t;
+    t += phase(s, 50);
+    s->edge[n++] = t;
+    s->active = 1;
+}
+
+static int dht_level(sim_dev_t *d, uint64_t t) {
+    sim_dht_t *s = (sim_dht_t *)d;
+    int i;
+
+    if (!s->active)
+        return 1;
+    for (i = 0; i < DHT_EDGES && s->edge[i] <= t; i++)
+        ;
+    /* Odd number of edges passed - sensor pulls low */
+    return !(i & 1);
+}
+
+/* temp and hum in tenths, as dht_read() returns them */
+sim_dev_t *sim_dht_add(int pin, int type, int temp, int hum) {
+    sim_dht_t *s = calloc(1, sizeof(*s));
+
+    s->type = type;
+    s->temp = temp;
+    s->hum = hum;
+    s->clock = 100;
+    s->rng = pin + 1;
+    s->dev.edge = dht_edge;
+    s->dev.level = dht_level;
+    hal_sim_attach(&s->dev, pin);
+    return &s->dev;
+}
+
+void sim_dht_set(sim_dev_t *d, int temp, int hum) {
+    sim_dht_t *s = (sim_dht_t *)d;
+
+    s->temp = temp;
+    s->hum = hum;
+}
+
+/* Sensor clock in % of nominal (>100 - faster, shorter phases), jitter in us */
+void sim_dht_timing(sim_dev_t *d, int clock, int jitter) {
+    sim_dht_t *s = (sim_dht_t *)d;
+
+    s->clock = clock;
+    s->jitter = jitter;
+}
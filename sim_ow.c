@@ -0,0 +1,400 @@
+/*
+ * Copyright (C) 2017, Denys Fedoryshchenko
+ * Contact: <nuclearcat@nuclearcat.com>
+ * Licensed under the GPLv2
+ * <http://www.gnu.org/licenses/old-licenses/gpl-2.0.txt>
+ *
+ * Simulated 1-Wire temperature sensors for hal_linux.c
+ * DS1820/DS18S20 (family 0x10) and DS18B20 (0x28): ROM commands including
+ * search and overdrive, scratchpad with crc, EEPROM, conversion time by
+ * resolution, parasite or external power. Parasite device converts only if
+ * master drives bus high for whole conversion, else reads power-on 85C.
+ * Device only looks at length of low pulses master makes, as real one does.
+ */
+#include <stdlib.h>
+#include "hal.h"
+
+#define ST_IDLE     0   /* wait for reset */
+#define ST_ROM      1   /* receiving ROM command */
+#define ST_MATCH    2   /* receiving ROM code to compare */
+#define ST_SEARCH   3   /* search triplets */
+#define ST_FUNC     4   /* receiving function command */
+#define ST_SEND     5   /* sending tx */
+#define ST_RECV     6   /* receiving scratchpad bytes */
+#define ST_BUSY     7   /* conversion or copy, read slots give 0 until done */
+
+/* Thresholds and timings by speed, standard / overdrive */
+#define RESET_MIN       HAL_US(240)
+#define OD_RESET_MIN    HAL_US(48)
+#define W1_MAX(od)      ( (od) ? HAL_US(2) : HAL_US(15) )
+#define HOLD(od)        ( (od) ? HAL_US(4) : HAL_US(30) )
+#define PRES_FROM(od)   ( (od) ? HAL_US(2) : HAL_US(30) )
+#define PRES_UNTIL(od)  ( (od) ? HAL_US(10) : HAL_US(150) )
+#define PULLUP_MAX      HAL_US(10)  /* strong pullup after CONVERT T */
+
+typedef struct {
+    sim_dev_t dev;
+    uint8_t rom[8];
+    uint8_t sp[9];
+    uint8_t ee[3];      /* TH, TL, config */
+    int32_t temp_mc;
+    int parasite;
+    int od_capable;
+    int od;
+    int alarm;
+    int state;
+    int after;          /* state after ST_SEND */
+    uint8_t buf[9];
+    int nbits;
+    int want;
+    uint8_t tx[9];
+    int txbits;
+    int txpos;
+    int phase;          /* search: 0 bit, 1 complement, 2 direction */
+    int sbit;
+    uint64_t fall;
+    uint64_t hold_from;
+    uint64_t hold_until;
+    uint64_t busy_until;
+    uint64_t conv_from;     /* parasite conversion to check, 0 none */
+    uint64_t drive_from;    /* master drives bus high since */
+} sim_ds_t;
+
+static uint8_t sim_crc8(const uint8_t *p, int len) {
+    uint8_t crc = 0, b;
+    int i;
+
+    while (len--) {
+        b = *p++;
+        for (i = 0; i < 8; i++) {
+            if ((crc ^ b) & 1)
+                crc = (crc >> 1) ^ 0x8C;
+            else
+                crc >>= 1;
+            b >>= 1;
+        }
+    }
+    return crc;
+}
+
+static int32_t fdiv(int32_t a, int32_t b) {
+    return (a >= 0) ? a / b : -((-a + b - 1) / b);
+}
+
+static int bit_of(const uint8_t *p, int n) {
+    return (p[n >> 3] >> (n & 7)) & 1;
+}
+
+static void sp_crc(sim_ds_t *s) {
+    s->sp[8] = sim_crc8(s->sp, 8);
+}
+
+/* Temperature into scratchpad as device would do at end of conversion */
+static void convert(sim_ds_t *s) {
+    int32_t raw, whole;
+
+    if (s->rom[0] == 0x10) {
+        int32_t raw9 = fdiv(s->temp_mc * 2 + 500, 1000);
+        int32_t t16 = fdiv(s->temp_mc * 16 + 500, 1000);
+        int32_t remain = ((raw9 >> 1) << 4) + 12 - t16;
+
+        if (remain < 0)
+            remain = 0;
+        if (remain > 16)
+            remain = 16;
+        raw = raw9;
+        whole = raw9 >> 1;
+        s->sp[6] = remain;
+        s->sp[7] = 0x10;
+    } else {
+        int res = (s->sp[4] >> 5) & 3;
+
+        raw = fdiv(s->temp_mc * 16, 1000);
+        raw &= ~((1 << (3 - res)) - 1);
+        whole = raw >> 4;
+    }
+    s->sp[0] = raw & 0xFF;
+    s->sp[1] = (raw >> 8) & 0xFF;
+    sp_crc(s);
+    s->alarm = whole >= (int8_t)s->sp[2] || whole <= (int8_t)s->sp[3];
+}
+
+/* Parasite conversion without strong pullup: power-on value, 85C */
+static void conv_fail(sim_ds_t *s) {
+    if (s->rom[0] == 0x10) {
+        s->sp[0] = 0xAA;
+        s->sp[1] = 0x00;
+        s->sp[6] = 0x0C;
+    } else {
+        s->sp[0] = 0x50;
+        s->sp[1] = 0x05;
+    }
+    sp_crc(s);
+    s->alarm = 85 >= (int8_t)s->sp[2] || 85 <= (int8_t)s->sp[3];
+}
+
+static uint64_t conv_time(sim_ds_t *s) {
+    if (s->rom[0] == 0x10)
+        return HAL_US(750000);
+    return HAL_US(93750) << ((s->sp[4] >> 5) & 3);
+}
+
+static void recv(sim_ds_t *s, int state, int bits) {
+    s->state = state;
+    s->nbits = 0;
+    s->want = bits;
+    memset(s->buf, 0, sizeof(s->buf));
+}
+
+static void send(sim_ds_t *s, const uint8_t *p, int bits, int after) {
+    memcpy(s->tx, p, (bits + 7) / 8);
+    s->txbits = bits;
+    s->txpos = 0;
+    s->after = after;
+    s->state = ST_SEND;
+}
+
+static void received(sim_ds_t *s, uint64_t t) {
+    uint8_t b;
+
+    switch (s->state) {
+    case ST_ROM:
+        switch (s->buf[0]) {
+        case 0x33:
+            send(s, s->rom, 64, ST_FUNC);
+            break;
+        case 0xCC:
+            recv(s, ST_FUNC, 8);
+            break;
+        case 0x55:
+            recv(s, ST_MATCH, 64);
+            break;
+        case 0xEC:
+            if (!s->alarm) {
+                s->state = ST_IDLE;
+                break;
+            }
+            /* fall through */
+        case 0xF0:
+            s->state = ST_SEARCH;
+            s->phase = 0;
+            s->sbit = 0;
+            break;
+        case 0x3C:
+            if (!s->od_capable) {
+                s->state = ST_IDLE;
+                break;
+            }
+            s->od = 1;
+            recv(s, ST_FUNC, 8);
+            break;
+        case 0x69:
+            if (!s->od_capable) {
+                s->state = ST_IDLE;
+                break;
+            }
+            s->od = 1;
+            recv(s, ST_MATCH, 64);
+            break;
+        default:
+            s->state = ST_IDLE;
+        }
+        break;
+    case ST_MATCH:
+        if (memcmp(s->buf, s->rom, 8))
+            s->state = ST_IDLE;
+        else
+            recv(s, ST_FUNC, 8);
+        break;
+    case ST_FUNC:
+        switch (s->buf[0]) {
+        case 0x44:
+            convert(s);
+            s->busy_until = t + conv_time(s);
+            if (s->parasite)
+                s->conv_from = t;
+            s->state = ST_BUSY;
+            break;
+        case 0xBE:
+            send(s, s->sp, 72, ST_IDLE);
+            break;
+        case 0x4E:
+            recv(s, ST_RECV, s->rom[0] == 0x10 ? 16 : 24);
+            break;
+        case 0x48:
+            memcpy(s->ee, &s->sp[2], 3);
+            s->busy_until = t + HAL_US(10000);
+            s->state = ST_BUSY;
+            break;
+        case 0xB8:
+            memcpy(&s->sp[2], s->ee, s->rom[0] == 0x10 ? 2 : 3);
+            sp_crc(s);
+            s->busy_until = t;
+            s->state = ST_BUSY;
+            break;
+        case 0xB4:
+            b = !s->parasite;
+            send(s, &b, 1, ST_IDLE);
+            break;
+        default:
+            s->state = ST_IDLE;
+        }
+        break;
+    case ST_RECV:
+        s->sp[2] = s->buf[0];
+        s->sp[3] = s->buf[1];
+        if (s->rom[0] != 0x10)
+            s->sp[4] = (s->buf[2] & 0x60) | 0x1F;
+        sp_crc(s);
+        s->state = ST_IDLE;
+        break;
+    }
+}
+
+static void ds_edge(sim_dev_t *d, int level, uint64_t t) {
+    sim_ds_t *s = (sim_ds_t *)d;
+    uint64_t low;
+    int bit;
+
+    if (!level) {
+        /* Bus pulled low before strong pullup ended */
+        if (s->conv_from) {
+            s->conv_from = 0;
+            conv_fail(s);
+        }
+        /* Start of slot, decide what we send */
+        s->fall = t;
+        bit = 1;
+        if (s->state == ST_SEND)
+            bit = bit_of(s->tx, s->txpos);
+        else if (s->state == ST_SEARCH && s->phase < 2)
+            bit = bit_of(s->rom, s->sbit) ^ s->phase;
+        else if (s->state == ST_BUSY && !s->parasite)
+            bit = t >= s->busy_until;
+        if (!bit) {
+            s->hold_from = t;
+            s->hold_until = t + HOLD(s->od);
+        }
+        return;
+    }
+
+    low = t - s->fall;
+    if (low >= RESET_MIN || (s->od && low >= OD_RESET_MIN)) {
+        if (low >= RESET_MIN)
+            s->od = 0;
+        recv(s, ST_ROM, 8);
+        s->hold_from = t + PRES_FROM(s->od);
+        s->hold_until = t + PRES_UNTIL(s->od);
+        return;
+    }
+
+    bit = low < W1_MAX(s->od);
+    switch (s->state) {
+    case ST_ROM:
+    case ST_MATCH:
+    case ST_FUNC:
+    case ST_RECV:
+        s->buf[s->nbits >> 3] |= bit << (s->nbits & 7);
+        if (++s->nbits == s->want)
+            received(s, t);
+        break;
+    case ST_SEND:
+        if (++s->txpos == s->txbits) {
+            if (s->after == ST_FUNC)
+                recv(s, ST_FUNC, 8);
+            else
+                s->state = s->after;
+        }
+        break;
+    case ST_SEARCH:
+        if (s->phase < 2) {
+            s->phase++;
+            break;
+        }
+        if (bit != bit_of(s->rom, s->sbit)) {
+            s->state = ST_IDLE;
+            break;
+        }
+        s->phase = 0;
+        if (++s->sbit == 64)
+            recv(s, ST_FUNC, 8);
+        break;
+    }
+}
+
+/* Strong pullup must come right after CONVERT T and last till it is done */
+static void ds_drive(sim_dev_t *d, int high, uint64_t t) {
+    sim_ds_t *s = (sim_ds_t *)d;
+
+    if (high) {
+        s->drive_from = t;
+        return;
+    }
+    if (!s->conv_from)
+        return;
+    if (s->drive_from < s->conv_from || s->drive_from > s->conv_from + PULLUP_MAX ||
+        t < s->busy_until)
+        conv_fail(s);
+    s->conv_from = 0;
+}
+
+static int ds_level(sim_dev_t *d, uint64_t t) {
+    sim_ds_t *s = (sim_ds_t *)d;
+
+    return !(t >= s->hold_from && t < s->hold_until);
+}
+
+/* Add sensor, serial is 48 bit unique part of ROM */
+sim_dev_t *sim_ow_add(int pin, uint8_t family, uint64_t serial, int32_t temp_mc) {
+    sim_ds_t *s = calloc(1, sizeof(*s));
+    int i;
+
+    s->rom[0] = family;
+    for (i = 1; i < 7; i++)
+        s->rom[i] = (serial >> (8 * (i - 1))) & 0xFF;
+    s->rom[7] = sim_crc8(s->rom, 7);
+
+    /* Power on state, 85C in scratchpad, factory EEPROM */
+    s->ee[0] = 0x4B;
+    s->ee[1] = 0x46;
+    s->ee[2] = 0x7F;
+    if (family == 0x10) {
+        s->sp[0] = 0xAA;
+        s->sp[6] = 0x0C;
+        s->sp[7] = 0x10;
+    } else {
+        s->sp[0] = 0x50;
+        s->sp[1] = 0x05;
+        s->sp[5] = 0xFF;
+        s->sp[6] = 0x0C;
+        s->sp[7] = 0x10;
+        s->sp[4] = s->ee[2];
+    }
+    s->sp[2] = s->ee[0];
+    s->sp[3] = s->ee[1];
+    sp_crc(s);
+
+    s->temp_mc = temp_mc;
+    s->state = ST_IDLE;
+    s->dev.edge = ds_edge;
+    s->dev.level = ds_level;
+    s->dev.drive = ds_drive;
+    hal_sim_attach(&s->dev, pin);
+    return &s->dev;
+}
+
+void sim_ow_set_temp(sim_dev_t *d, int32_t temp_mc) {
+    ((sim_ds_t *)d)->temp_mc = temp_mc;
+}
+
+void sim_ow_set_parasite(sim_dev_t *d, int parasite) {
+    ((sim_ds_t *)d)->parasite = parasite;
+}
+
+void sim_ow_set_overdrive(sim_dev_t *d, int capable) {
+    ((sim_ds_t *)d)->od_capable = capable;
+}
+
+const uint8_t *sim_ow_rom(sim_dev_t *d) {
+    return ((sim_ds_t *)d)->rom;
+}
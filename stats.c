@@ -0,0 +1,46 @@
+/*
+ * Copyright (C) 2017, Denys Fedoryshchenko
+ * Contact: <nuclearcat@nuclearcat.com>
+ * Licensed under the GPLv2
+ * <http://www.gnu.org/licenses/old-licenses/gpl-2.0.txt>
+ *
+ * Counters for stats.h. stats_add() is called from drivers, often with
+ * interrupts masked, so it only compares and increments, no division.
+ */
+#ifdef HAL_LINUX
+#include "hal.h"
+#else
+#include "esp_common.h"
+#endif
+#include "stats.h"
+
+static stats_t stats[STATS_MAX];
+
+void stats_add(int id, uint32_t cycles) {
+        stats_t *s = &stats[id];
+        uint32_t lim = STATS_BUCKET0;
+        int b;
+
+        if (!s->count || cycles < s->min)
+                s->min = cycles;
+        if (cycles > s->max)
+                s->max = cycles;
+        s->count++;
+        s->total += cycles;
+        for (b = 0; b < STATS_BUCKETS - 1 && cycles >= lim; b++)
+                lim <<= 2;
+        s->hist[b]++;
+}
+
+/* Consistent copy, drivers might update it meanwhile */
+void stats_get(int id, stats_t *s) {
+        portENTER_CRITICAL();
+        *s = stats[id];
+        portEXIT_CRITICAL();
+}
+
+void stats_reset(void) {
+        portENTER_CRITICAL();
+        memset(stats, 0, sizeof(stats));
+        portEXIT_CRITICAL();
+}
@@ -0,0 +1,67 @@
+/*
+ * Copyright (C) 2017, Denys Fedoryshchenko
+ * Contact: <nuclearcat@nuclearcat.com>
+ * Licensed under the GPLv2
+ * <http://www.gnu.org/licenses/old-licenses/gpl-2.0.txt>
+ *
+ * Driver instrumentation, built in only with -DDRV_STATS (and stats.c linked).
+ * Drivers mark start and end of masked windows and bus operations, durations
+ * in CCOUNT cycles go to min/max/total and a histogram per operation.
+ * Without DRV_STATS macros are empty, so there is no cost at all.
+ *
+ * stats_t s;
+ * stats_get(STATS_OW_MASKED, &s);
+ * printf("%u windows, max %u cycles\n", s.count, s.max);
+ */
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdint.h>
+
+#define STATS_OW_MASKED     0   /* ow.c, interrupts masked */
+#define STATS_OW_RESET      1   /* ow.c, reset and presence */
+#define STATS_OW_SLOT       2   /* ow.c, single read/write slot */
+#define STATS_OW_XFER       3   /* ow.c, onewire_lock() to onewire_unlock() */
+#define STATS_DS_MASKED     4   /* ds18b20.c, interrupts masked */
+#define STATS_DS_RESET      5   /* ds18b20.c, reset and presence */
+#define STATS_DHT_MASKED    6   /* dht.c, frame capture with interrupts masked */
+#define STATS_MAX           7
+
+/*
+ * Bucket i counts durations below STATS_BUCKET0 << 2i cycles, last one the
+ * rest. At 80MHz: <1us, <4us, <16us, <64us, <256us, <1ms, <4ms, more
+ */
+#define STATS_BUCKET0       80
+#define STATS_BUCKETS       8
+
+typedef struct {
+    uint32_t count;
+    uint32_t min;           /* cycles */
+    uint32_t max;
+    uint64_t total;
+    uint32_t hist[STATS_BUCKETS];
+} stats_t;
+
+void stats_add(int id, uint32_t cycles);
+void stats_get(int id, stats_t *s);
+void stats_reset(void);
+
+#ifdef DRV_STATS
+static inline uint32_t stats_ccount(void) {
+#ifdef HAL_LINUX
+    return hal_ccount();
+#else
+    uint32_t r;
+    __asm__ __volatile__("rsr     %0, ccount":"=a" (r));
+    return r;
+#endif
+}
+
+#define STATS_BEGIN(t)      ( (t) = stats_ccount() )
+#define STATS_END(id, t)    stats_add(id, stats_ccount() - (t))
+#else
+#define STATS_BEGIN(t)      do { } while (0)
+#define STATS_END(id, t)    do { } while (0)
+#endif
+
+#endif
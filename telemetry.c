@@ -0,0 +1,326 @@
+/*
+ * Copyright (C) 2017, Denys Fedoryshchenko
+ * Contact: <nuclearcat@nuclearcat.com>
+ * Licensed under the GPLv2
+ * <http://www.gnu.org/licenses/old-licenses/gpl-2.0.txt>
+ *
+ * Compact encoding of sensor readings for upload, instead of JSON text.
+ * Readings are written one by one into caller buffer (no allocations), batch
+ * is self contained, each one starts with empty sensor table.
+ *
+ * Sensor id is 64 bit ROM code (tlm_rom_id()) for DS1820, or pin number
+ * (TLM_DHT_ID()) for DHT, which has humidity as second value. ROM code is sent
+ * only on first reading of sensor in batch, later ones refer to its slot.
+ * Time (ms or ticks, any unit) is sent as delta of delta per sensor, so
+ * sensor read at fixed interval costs 1 byte, values (milli C, milli %RH) as
+ * delta from previous value of same sensor.
+ *
+ * TLM_RAW:  0x01, then per reading varint slot, [varint id if new slot],
+ *           zigzag varint dod time, dtemp, [dhum]
+ * TLM_CBOR: indefinite array (0x9F ... 0xFF) of arrays
+ *           [slot, [id if new slot], dod time, dtemp, [dhum]]
+ *
+ * tlm_begin(&e, buf, sizeof(buf), TLM_RAW);
+ * r.id = tlm_rom_id(rom); r.time = ms; r.temp = temp;
+ * if (tlm_add(&e, &r)) ... buffer is full, send batch and begin new one
+ * len = tlm_end(&e);
+ *
+ * tlm_decode() (Linux only, or with TLM_DECODER) gives readings back.
+ */
+#ifdef HAL_LINUX
+#include "hal.h"
+#else
+#include "esp_common.h"
+#endif
+#include "esp8266stuff.h"
+
+#define TLM_RAW_MAGIC   0x01
+#define CBOR_ARRAY      0x9F    /* indefinite length array */
+#define CBOR_BREAK      0xFF
+
+uint64_t tlm_rom_id(const uint8_t *rom) {
+        uint64_t id = 0;
+        int i;
+
+        for (i = 7; i >= 0; i--)
+                id = (id << 8) | rom[i];
+        return(id);
+}
+
+static void put(tlm_enc_t *e, uint8_t b) {
+        if (e->len < e->size)
+                e->buf[e->len] = b;
+        e->len++;
+}
+
+static void put_varint(tlm_enc_t *e, uint64_t v) {
+        while (v >= 0x80) {
+                put(e, (v & 0x7F) | 0x80);
+                v >>= 7;
+        }
+        put(e, v);
+}
+
+static void put_zigzag(tlm_enc_t *e, int32_t v) {
+        put_varint(e, ((uint32_t)v << 1) ^ (uint32_t)(v >> 31));
+}
+
+/* CBOR head: major type and shortest argument */
+static void put_cbor(tlm_enc_t *e, uint8_t major, uint64_t v) {
+        int n, i;
+
+        major <<= 5;
+        if (v < 24) {
+                put(e, major | v);
+                return;
+        }
+        if (v <= 0xFF) {
+                put(e, major | 24);
+                n = 1;
+        } else if (v <= 0xFFFF) {
+                put(e, major | 25);
+                n = 2;
+        } else if (v <= 0xFFFFFFFF) {
+                put(e, major | 26);
+                n = 4;
+        } else {
+                put(e, major | 27);
+                n = 8;
+        }
+        for (i = n - 1; i >= 0; i--)
+                put(e, v >> (8 * i));
+}
+
+static void put_cbor_int(tlm_enc_t *e, int32_t v) {
+        if (v >= 0)
+                put_cbor(e, 0, v);
+        else
+                put_cbor(e, 1, -1 - (int64_t)v);
+}
+
+static void put_uint(tlm_enc_t *e, uint64_t v) {
+        if (e->format == TLM_CBOR)
+                put_cbor(e, 0, v);
+        else
+                put_varint(e, v);
+}
+
+static void put_int(tlm_enc_t *e, int32_t v) {
+        if (e->format == TLM_CBOR)
+                put_cbor_int(e, v);
+        else
+                put_zigzag(e, v);
+}
+
+int tlm_begin(tlm_enc_t *e, uint8_t *buf, int size, int format) {
+        memset(e, 0, sizeof(*e));
+        e->buf = buf;
+        /* Keep room for CBOR break, so tlm_end() always fits */
+        e->size = (format == TLM_CBOR) ? size - 1 : size;
+        e->format = format;
+        put(e, (format == TLM_CBOR) ? CBOR_ARRAY : TLM_RAW_MAGIC);
+        if (e->len > e->size)
+                return(-1);
+        return(0);
+}
+
+/*
+ * Returns 0, or -1 if reading doesn't fit in buffer or sensor table (batch is
+ * left as it was)
+ */
+int tlm_add(tlm_enc_t *e, const tlm_reading_t *r) {
+        tlm_sensor_t *s, fresh;
+        int slot, len = e->len;
+        int32_t delta;
+
+        for (slot = 0; slot < e->nsensors; slot++) {
+                if (e->s[slot].id == r->id)
+                        break;
+        }
+        if (slot == TLM_SENSORS)
+                return(-1);
+        s = &e->s[slot];
+        if (slot == e->nsensors) {
+                /* New sensor starts from last time in batch */
+                memset(&fresh, 0, sizeof(fresh));
+                fresh.id = r->id;
+                fresh.time = e->time;
+                s = &fresh;
+        }
+        delta = r->time - s->time;
+
+        if (e->format == TLM_CBOR)
+                put_cbor(e, 4, (TLM_HAS_HUM(r->id) ? 4 : 3) + (s == &fresh));
+        put_uint(e, slot);
+        if (s == &fresh)
+                put_uint(e, r->id);
+        put_int(e, (uint32_t)delta - (uint32_t)s->delta);
+        put_int(e, r->temp - s->temp);
+        if (TLM_HAS_HUM(r->id))
+                put_int(e, r->hum - s->hum);
+
+        if (e->len > e->size) {
+                e->len = len;
+                return(-1);
+        }
+        if (s == &fresh)
+                e->s[e->nsensors++] = fresh;
+        s = &e->s[slot];
+        s->time = r->time;
+        s->delta = delta;
+        s->temp = r->temp;
+        s->hum = r->hum;
+        e->time = r->time;
+        e->count++;
+        return(0);
+}
+
+/* Returns batch length */
+int tlm_end(tlm_enc_t *e) {
+        if (e->format == TLM_CBOR) {
+                e->buf[e->len++] = CBOR_BREAK;
+                e->size++;
+        }
+        return(e->len);
+}
+
+#if defined(HAL_LINUX) || defined(TLM_DECODER)
+typedef struct {
+        const uint8_t *p;
+        const uint8_t *end;
+        int format;
+        int error;
+} tlm_in_t;
+
+static uint64_t get_varint(tlm_in_t *in) {
+        uint64_t v = 0;
+        int shift = 0;
+
+        while (in->p < in->end && shift < 64) {
+                v |= (uint64_t)(*in->p & 0x7F) << shift;
+                if (!(*in->p++ & 0x80))
+                        return(v);
+                shift += 7;
+        }
+        in->error = 1;
+        return(0);
+}
+
+/* Argument of CBOR head, major type into *major */
+static uint64_t get_cbor(tlm_in_t *in, int *major) {
+        uint64_t v;
+        int n;
+
+        if (in->p >= in->end) {
+                in->error = 1;
+                return(0);
+        }
+        *major = *in->p >> 5;
+        v = *in->p++ & 0x1F;
+        if (v < 24)
+                return(v);
+        if (v > 27) {
+                in->error = 1;
+                return(0);
+        }
+        n = 1 << (v - 24);
+        if (in->end - in->p < n) {
+                in->error = 1;
+                return(0);
+        }
+        v = 0;
+        while (n--)
+                v = (v << 8) | *in->p++;
+        return(v);
+}
+
+static int32_t get_int(tlm_in_t *in) {
+        uint64_t v;
+        int major;
+
+        if (in->format == TLM_RAW) {
+                v = get_varint(in);
+                return((int32_t)((v >> 1) ^ -(v & 1)));
+        }
+        v = get_cbor(in, &major);
+        if (major == 1)
+                return(-1 - (int64_t)v);
+        if (major != 0)
+                in->error = 1;
+        return(v);
+}
+
+static uint64_t get_uint(tlm_in_t *in) {
+        int major;
+        uint64_t v;
+
+        if (in->format == TLM_RAW)
+                return(get_varint(in));
+        v = get_cbor(in, &major);
+        if (major != 0)
+                in->error = 1;
+        return(v);
+}
+
+/* Calls cb for each reading, returns number of readings or -1 on bad data */
+int tlm_decode(const uint8_t *buf, int len, void (*cb)(void *ctx, const tlm_reading_t *r), void *ctx) {
+        tlm_sensor_t s[TLM_SENSORS];
+        tlm_reading_t r;
+        tlm_in_t in;
+        uint32_t time = 0;
+        int nsensors = 0, count = 0, items = 0, major;
+        uint64_t slot;
+        int32_t delta;
+
+        if (len < 1)
+                return(-1);
+        in.p = buf + 1;
+        in.end = buf + len;
+        in.error = 0;
+        if (buf[0] == TLM_RAW_MAGIC)
+                in.format = TLM_RAW;
+        else if (buf[0] == CBOR_ARRAY)
+                in.format = TLM_CBOR;
+        else
+                return(-1);
+
+        while (in.p < in.end) {
+                if (in.format == TLM_CBOR) {
+                        if (*in.p == CBOR_BREAK)
+                                return(in.p + 1 == in.end ? count : -1);
+                        items = get_cbor(&in, &major);
+                        if (major != 4)
+                                return(-1);
+                }
+                slot = get_uint(&in);
+                if (slot > (uint64_t)nsensors || slot == TLM_SENSORS)
+                        return(-1);
+                if (slot == (uint64_t)nsensors) {
+                        memset(&s[slot], 0, sizeof(s[slot]));
+                        s[slot].id = get_uint(&in);
+                        s[slot].time = time;
+                        nsensors++;
+                        items--;
+                }
+                memset(&r, 0, sizeof(r));
+                r.id = s[slot].id;
+                delta = (uint32_t)s[slot].delta + (uint32_t)get_int(&in);
+                r.time = s[slot].time + delta;
+                r.temp = s[slot].temp + get_int(&in);
+                if (TLM_HAS_HUM(r.id))
+                        r.hum = s[slot].hum + get_int(&in);
+                if (in.error || (in.format == TLM_CBOR && items != (TLM_HAS_HUM(r.id) ? 4 : 3)))
+                        return(-1);
+                s[slot].time = r.time;
+                s[slot].delta = delta;
+                s[slot].temp = r.temp;
+                s[slot].hum = r.hum;
+                time = r.time;
+                count++;
+                if (cb)
+                        cb(ctx, &r);
+        }
+        /* CBOR batch must end with break */
+        return(in.format == TLM_RAW ? count : -1);
+}
+#endif
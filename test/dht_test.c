@@ -0,0 +1,158 @@
+/*
+ * Copyright (C) 2017, Denys Fedoryshchenko
+ * Contact: <nuclearcat@nuclearcat.com>
+ * Licensed under the GPLv2
+ * <http://www.gnu.org/licenses/old-licenses/gpl-2.0.txt>
+ *
+ * dht.c: single read with calibrated threshold, DHT11 in whole units, and
+ * several pins in one capture loop. Built again with -DIRQ_CAPTURE
+ * (dht_irq_test), there application GPIO handler must keep its pin during read.
+ */
+#include "test.h"
+
+#define THIGH1_MIN  49  /* dht.c threshold without calibration, us */
+
+static void test_single(void) {
+    sim_dev_t *d = sim_dht_add(4, 22, -123, 456);
+    int32_t mt, mh;
+    dht_cal_t cal;
+    int t, h;
+
+    dht_init();
+    CHECK_EQ(dht_read(&t, &h), 0);
+    CHECK_EQ(t, -123);
+    CHECK_EQ(h, 456);
+    dht_cal_get(&cal);
+    CHECK(cal.min1 > cal.threshold && cal.max0 < cal.threshold);
+
+    sim_dht_set(d, 251, 999);
+    CHECK_EQ(dht_read_mc(&mt, &mh), 0);
+    CHECK_EQ(mt, 25100);
+    CHECK_EQ(mh, 99900);
+    hal_sim_detach(d);
+}
+
+/*
+ * Sensor clock 45% fast with 3us jitter: its 1 (~48us) is under nominal
+ * threshold, so fixed threshold would read it as 0, threshold from preamble
+ * still separates bits
+ */
+static void test_fast_clock(void) {
+    sim_dev_t *d = sim_dht_add(4, 22, 215, 456);
+    dht_cal_t cal;
+    uint32_t pre;
+    int t, h;
+
+    sim_dht_timing(d, 145, 3);
+    CHECK_EQ(dht_read(&t, &h), 0);
+    CHECK_EQ(t, 215);
+    CHECK_EQ(h, 456);
+    dht_cal_get(&cal);
+    pre = cal.preamble;
+    CHECK_EQ(cal.threshold, (pre >> 2) + (pre >> 5) + (pre >> 6));
+    CHECK(cal.max0 < cal.threshold && cal.min1 > cal.threshold);
+    CHECK(cal.min1 < THIGH1_MIN * HAL_CPU_MHZ);
+    hal_sim_detach(d);
+}
+
+/* DHT11 has no decimals, dht_read() gives whole units, rest milli units */
+static void test_dht11(void) {
+    sim_dev_t *d = sim_dht_add(4, 11, 230, 450);
+    int32_t temp[16], hum[16], mt, mh;
+    int status[16], t, h;
+
+    CHECK_EQ(dht_read(&t, &h), 0);
+    CHECK_EQ(t, 23);
+    CHECK_EQ(h, 45);
+    CHECK_EQ(dht_read_mc(&mt, &mh), 0);
+    CHECK_EQ(mt, 23000);
+    CHECK_EQ(mh, 45000);
+    hal_sim_detach(d);
+
+    /* 0-4C doesn't look like DHT11 by temperature alone */
+    sim_dht_add(0, 11, 20, 900);
+    sim_dht_add(2, 22, 20, 900);
+    CHECK_EQ(dht_read_multi((1 << 0) | (1 << 2), temp, hum, status), (1 << 0) | (1 << 2));
+    CHECK_EQ(temp[0], 2000);
+    CHECK_EQ(hum[0], 90000);
+    CHECK_EQ(temp[2], 2000);
+    CHECK_EQ(hum[2], 90000);
+}
+
+#ifdef IRQ_CAPTURE
+/* Signal on pin 5 toggling each 1ms, as some other interrupt source */
+static void square_edge(sim_dev_t *d, int level, uint64_t t) {
+}
+
+static int square_level(sim_dev_t *d, uint64_t t) {
+    return (t / HAL_US(1000)) & 1;
+}
+
+static int app_edges;
+
+static void app_isr(void *arg) {
+    uint32_t status = GPIO_REG_READ(GPIO_STATUS_ADDRESS);
+
+    GPIO_REG_WRITE(GPIO_STATUS_W1TC_ADDRESS, status);
+    if (status & (1 << 5))
+        app_edges++;
+}
+
+static void test_chain(void) {
+    sim_dev_t sq = { .edge = square_edge, .level = square_level };
+    sim_dev_t *d = sim_dht_add(4, 22, 215, 456);
+    int t, h, n;
+
+    hal_sim_attach(&sq, 5);
+    dht_irq_chain(app_isr, NULL);
+    gpio_pin_intr_state_set(5, GPIO_PIN_INTR_ANYEDGE);
+    _xt_isr_unmask(1 << ETS_GPIO_INUM);
+
+    /* 25+18ms before release, then frame within 2 ticks */
+    CHECK_EQ(dht_read(&t, &h), 0);
+    CHECK_EQ(t, 215);
+    CHECK(app_edges >= 60);
+    /* Handler is back after read */
+    n = app_edges;
+    vTaskDelay(1);
+    CHECK(app_edges >= n + 9);
+
+    gpio_pin_intr_state_set(5, GPIO_PIN_INTR_DISABLE);
+    hal_sim_detach(&sq);
+    hal_sim_detach(d);
+}
+#endif
+
+/* Pin without sensor fails alone, others are read */
+static void test_multi(void) {
+    int32_t temp[16], hum[16];
+    int status[16];
+    uint32_t mask = (1 << 12) | (1 << 13) | (1 << 14) | (1 << 15);
+
+    sim_dht_add(12, 22, 215, 456);
+    sim_dht_add(13, 22, -30, 800);
+    sim_dht_add(14, 22, 1000, 1000);
+    hal_stats_reset();
+    CHECK_EQ(dht_read_multi(mask, temp, hum, status), (1 << 12) | (1 << 13) | (1 << 14));
+    CHECK(test_ms() < 60);
+    CHECK_EQ(status[12], 0);
+    CHECK_EQ(temp[12], 21500);
+    CHECK_EQ(hum[12], 45600);
+    CHECK_EQ(temp[13], -3000);
+    CHECK_EQ(hum[13], 80000);
+    CHECK_EQ(temp[14], 100000);
+    CHECK_EQ(status[15], 1);
+}
+
+int main(void) {
+    test_single();
+    test_fast_clock();
+    test_multi();
+    test_dht11();
+#ifdef IRQ_CAPTURE
+    test_chain();
+    return test_done("dht_irq_test");
+#else
+    return test_done("dht_test");
+#endif
+}
@@ -0,0 +1,138 @@
+/*
+ * Copyright (C) 2017, Denys Fedoryshchenko
+ * Contact: <nuclearcat@nuclearcat.com>
+ * Licensed under the GPLv2
+ * <http://www.gnu.org/licenses/old-licenses/gpl-2.0.txt>
+ *
+ * Conditional GET against local server (test/http_server.py, make poll):
+ * first poll downloads config and keeps validators in (file) flash, second
+ * one sends them and ends with 304. Prints bytes received by each. Then
+ * batch of sensor readings is POSTed pipelined on one connection, with HEAD
+ * of config in the middle, all must be answered in order.
+ */
+#include "hal.h"
+#include "esp8266stuff.h"
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+
+#define UPLOADS 8
+
+static int body_bytes;
+static int done_count, done_bad;
+
+static void on_body(void *ctx, char *buf, int len) {
+    body_bytes += len;
+}
+
+static int connect_local(int port) {
+    struct sockaddr_in a = { .sin_family = AF_INET, .sin_port = htons(port) };
+    int s;
+
+    s = socket(AF_INET, SOCK_STREAM, 0);
+    inet_pton(AF_INET, "127.0.0.1", &a.sin_addr);
+    if (s >= 0 && connect(s, (struct sockaddr *)&a, sizeof(a))) {
+        close(s);
+        return -1;
+    }
+    return s;
+}
+
+/* Reading i is answered 201, HEAD (after UPLOADS / 2 readings) 200 */
+static void on_done(void *ctx, int status, int keepalive) {
+    int head = done_count == UPLOADS / 2;
+
+    if (status != (head ? 200 : 201) || !keepalive)
+        done_bad++;
+    done_count++;
+}
+
+/* Returns 0 if all requests got their response */
+static int upload(int port) {
+    char req[2048], body[64], buf[1460];
+    http_pipe_t pp;
+    http_req_t r;
+    int s, i, len = 0, n, total = 0;
+
+    s = connect_local(port);
+    if (s < 0)
+        return -1;
+    http_pipe_init(&pp, on_body, on_done, NULL);
+    for (i = 0; i < UPLOADS; i++) {
+        if (i == UPLOADS / 2) {
+            http_req_begin(&r, req + len, sizeof(req) - len, "HEAD", "localhost", "/cfg.json");
+            len += http_req_end(&r, NULL, 0);
+            http_pipe_sent(&pp, HTTP_NOBODY);
+        }
+        n = snprintf(body, sizeof(body), "id=%d&temp=%d", i, 21500 + i * 62);
+        http_req_begin(&r, req + len, sizeof(req) - len, "POST", "localhost", "/sensor");
+        http_req_header(&r, "Content-Type", "application/x-www-form-urlencoded");
+        len += http_req_end(&r, body, n);
+        http_pipe_sent(&pp, 0);
+    }
+    send(s, req, len, 0);
+
+    body_bytes = done_count = done_bad = 0;
+    while (pp.pending > 0 && (n = recv(s, buf, sizeof(buf), 0)) > 0) {
+        total += n;
+        if (http_pipe_feed(&pp, buf, n) < 0)
+            break;
+    }
+    close(s);
+    printf("pipelined %d requests in %d bytes, received %d bytes (body %d), answered %d, bad %d\n",
+           UPLOADS + 1, len, total, body_bytes, done_count, done_bad);
+    return (done_count == UPLOADS + 1 && !done_bad) ? 0 : 1;
+}
+
+/* Returns bytes received, -1 if server is not there */
+static int poll_once(http_cache_t *c, int port) {
+    char req[512], buf[1460];
+    http_validator_t fresh, *v;
+    http_parser_t p;
+    http_req_t r;
+    int s, len, n, total = 0;
+
+    s = connect_local(port);
+    if (s < 0)
+        return -1;
+    v = http_cache_get(c, "localhost", "/cfg.json");
+    http_req_begin(&r, req, sizeof(req), "GET", "localhost", "/cfg.json");
+    http_req_conditional(&r, v);
+    len = http_req_end(&r, NULL, 0);
+    send(s, req, len, 0);
+
+    http_parser_init(&p, on_body, NULL);
+    http_parser_validators(&p, &fresh);
+    body_bytes = 0;
+    while (p.state != HP_DONE && p.state != HP_ERROR && (n = recv(s, buf, sizeof(buf), 0)) > 0) {
+        total += n;
+        http_parse(&p, buf, n);
+    }
+    if (p.state != HP_DONE)
+        http_parse(&p, NULL, 0);
+    close(s);
+    printf("request %d bytes, status %d, received %d bytes (body %d), not modified %d\n",
+           len, p.status, total, body_bytes, http_cache_update(c, v, &fresh, p.status));
+    http_cache_save(c);
+    return total;
+}
+
+int main(int argc, char **argv) {
+    int port = argc > 1 ? atoi(argv[1]) : 18080;
+    char flash[256];
+    http_cache_t c;
+    int r;
+
+    snprintf(flash, sizeof(flash), "%s.flash", argv[0]);
+    remove(flash);
+    hal_flash_open(flash, 64 * SPI_FLASH_SEC_SIZE);
+    http_cache_load(&c, 8);
+    if (poll_once(&c, port) < 0 || poll_once(&c, port) < 0) {
+        printf("no server on port %d\n", port);
+        return 1;
+    }
+    r = upload(port);
+    remove(flash);
+    return r;
+}
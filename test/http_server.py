@@ -0,0 +1,48 @@
+#!/usr/bin/env python3
+# Stand-in config server for http_poll: 740 byte JSON with ETag and
+# Last-Modified, 304 on matching If-None-Match/If-Modified-Since. HEAD of it,
+# POST of sensor readings answered by 201 with id of reading.
+import http.server
+import sys
+
+BODY = b'{"interval": 60, "ota": "fw-1.2.bin"}' * 20
+ETAG = '"cfg-v7"'
+MODIFIED = 'Tue, 13 Oct 2026 10:00:00 GMT'
+
+
+class Handler(http.server.BaseHTTPRequestHandler):
+    protocol_version = 'HTTP/1.1'
+
+    def do_GET(self):
+        match = self.headers.get('If-None-Match')
+        if match == ETAG or (not match and self.headers.get('If-Modified-Since') == MODIFIED):
+            self.send_response(304)
+            self.send_header('ETag', ETAG)
+            self.end_headers()
+            return
+        self.send_response(200)
+        self.send_header('ETag', ETAG)
+        self.send_header('Last-Modified', MODIFIED)
+        self.send_header('Content-Length', str(len(BODY)))
+        self.end_headers()
+        self.wfile.write(BODY)
+
+    def do_HEAD(self):
+        self.send_response(200)
+        self.send_header('ETag', ETAG)
+        self.send_header('Content-Length', str(len(BODY)))
+        self.end_headers()
+
+    def do_POST(self):
+        data = self.rfile.read(int(self.headers.get('Content-Length', 0)))
+        reply = b'stored ' + data.split(b'&')[0]
+        self.send_response(201)
+        self.send_header('Content-Length', str(len(reply)))
+        self.end_headers()
+        self.wfile.write(reply)
+
+    def log_message(self, *args):
+        pass
+
+
+http.server.HTTPServer(('127.0.0.1', int(sys.argv[1])), Handler).serve_forever()
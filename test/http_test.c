@@ -0,0 +1,315 @@
+/*
+ * Copyright (C) 2017, Denys Fedoryshchenko
+ * Contact: <nuclearcat@nuclearcat.com>
+ * Licensed under the GPLv2
+ * <http://www.gnu.org/licenses/old-licenses/gpl-2.0.txt>
+ *
+ * microhttpclient.c on canned responses: framing, split receive buffers,
+ * header spans, validators, pipelining, EOF, request builder and validator
+ * cache in (file) flash. No network needed.
+ */
+#include "test.h"
+
+static char body[2048];
+static int body_len;
+static char hdr[256];
+static int hdr_len, hdr_count;
+static int done_status[8], done_keepalive[8], done_count;
+static char done_etag[8][HTTP_ETAG_LEN];
+static http_validator_t pipe_valid;
+
+static void on_body(void *ctx, char *buf, int len) {
+    if (body_len + len < (int)sizeof(body)) {
+        memcpy(body + body_len, buf, len);
+        body_len += len;
+        body[body_len] = 0;
+    }
+}
+
+/* Headers as name=value; with fragments joined */
+static void on_header(void *ctx, int part, char *buf, int len) {
+    static int in_value;
+
+    if (hdr_len + len + 2 >= (int)sizeof(hdr))
+        return;
+    if (part == HTTP_HDR_VALUE && !in_value) {
+        hdr[hdr_len++] = '=';
+        in_value = 1;
+    }
+    memcpy(hdr + hdr_len, buf, len);
+    hdr_len += len;
+    if (part == HTTP_HDR_END) {
+        hdr[hdr_len++] = ';';
+        hdr_count++;
+        in_value = 0;
+    }
+    hdr[hdr_len] = 0;
+}
+
+static void on_done(void *ctx, int status, int keepalive) {
+    if (done_count < 8) {
+        done_status[done_count] = status;
+        done_keepalive[done_count] = keepalive;
+        strcpy(done_etag[done_count], pipe_valid.etag);
+    }
+    done_count++;
+}
+
+static void reset(http_parser_t *p) {
+    body_len = hdr_len = hdr_count = 0;
+    body[0] = hdr[0] = 0;
+    http_parser_init(p, on_body, NULL);
+    http_parser_headers(p, on_header);
+}
+
+/* Whole response in pieces of step bytes, returns last http_parse() result */
+static int feed(http_parser_t *p, const char *resp, int step) {
+    static char buf[2048];
+    int len = strlen(resp), i, n, r = 0;
+
+    memcpy(buf, resp, len);
+    for (i = 0; i < len && p->state != HP_DONE; i += n) {
+        n = len - i < step ? len - i : step;
+        r = http_parse(p, buf + i, n);
+        if (r < 0)
+            return r;
+    }
+    return r;
+}
+
+static void test_length(void) {
+    const char *resp = "HTTP/1.1 200 OK\r\nContent-Length: 5\r\nX-Long: "
+                       "some value here\r\n\r\nhelloHTTP";
+    http_parser_t p;
+    int step;
+
+    for (step = 1; step <= 64; step *= 4) {
+        reset(&p);
+        feed(&p, resp, step);
+        CHECK_EQ(p.state, HP_DONE);
+        CHECK_EQ(p.status, 200);
+        CHECK(!strcmp(body, "hello"));
+        CHECK(!strcmp(hdr, "Content-Length=5;X-Long=some value here;"));
+        CHECK_EQ(hdr_count, 2);
+        CHECK(http_keepalive(&p));
+    }
+}
+
+static void test_chunked(void) {
+    const char *resp = "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n"
+                       "Connection: close\r\n\r\n5;ext=1\r\nhello\r\n"
+                       "A\r\n0123456789\r\n0\r\nTrailer: x\r\n\r\n";
+    http_parser_t p;
+    int step;
+
+    for (step = 1; step <= 64; step *= 4) {
+        reset(&p);
+        feed(&p, resp, step);
+        CHECK_EQ(p.state, HP_DONE);
+        CHECK(!strcmp(body, "hello0123456789"));
+        CHECK(!http_keepalive(&p));
+    }
+}
+
+static void test_nobody(void) {
+    http_parser_t p;
+
+    reset(&p);
+    feed(&p, "HTTP/1.1 100 Continue\r\n\r\nHTTP/1.1 304 Not Modified\r\n\r\n", 7);
+    CHECK_EQ(p.state, HP_DONE);
+    CHECK_EQ(p.status, 304);
+
+    reset(&p);
+    p.flags |= HTTP_NOBODY;
+    feed(&p, "HTTP/1.1 200 OK\r\nContent-Length: 100\r\n\r\n", 100);
+    CHECK_EQ(p.state, HP_DONE);
+    CHECK_EQ(body_len, 0);
+}
+
+/* Body till close ends only at EOF, anything else there is truncated */
+static void test_eof(void) {
+    http_parser_t p;
+
+    reset(&p);
+    feed(&p, "HTTP/1.0 200 OK\r\n\r\nuntil close", 5);
+    CHECK_EQ(p.state, HP_BODY_CLOSE);
+    CHECK_EQ(http_parse(&p, NULL, 0), 0);
+    CHECK_EQ(p.state, HP_DONE);
+    CHECK(!strcmp(body, "until close"));
+    CHECK(!http_keepalive(&p));
+
+    reset(&p);
+    feed(&p, "HTTP/1.1 200 OK\r\nContent-Length: 10\r\n\r\nshort", 100);
+    CHECK_EQ(http_parse(&p, NULL, 0), -1);
+}
+
+static void test_errors(void) {
+    http_parser_t p;
+
+    reset(&p);
+    CHECK_EQ(feed(&p, "HTTP/1.1 200 OK\r\nContent-Length: 4294967296\r\n\r\n", 100), -1);
+    reset(&p);
+    CHECK(feed(&p, "HTTP/1.1 200 OK\r\nContent-Length: 4294967295\r\n\r\n", 100) > 0);
+    CHECK_EQ(p.length, 4294967295u);
+    reset(&p);
+    CHECK_EQ(feed(&p, "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n"
+                      "100000000\r\n", 100), -1);
+    reset(&p);
+    CHECK_EQ(feed(&p, "SMTP 220\r\n\r\n", 100), -1);
+    reset(&p);
+    CHECK_EQ(feed(&p, "HTTP/1.1 2x0 OK\r\n\r\n", 100), -1);
+
+    /* Repeated Content-Length is fine only with same value */
+    reset(&p);
+    CHECK(feed(&p, "HTTP/1.1 200 OK\r\nContent-Length: 2\r\nContent-Length: 2\r\n\r\nok", 7) > 0);
+    CHECK_EQ(p.state, HP_DONE);
+    CHECK_EQ(body_len, 2);
+    reset(&p);
+    CHECK_EQ(feed(&p, "HTTP/1.1 200 OK\r\nContent-Length: 2\r\nContent-Length: 20\r\n\r\nok", 7), -1);
+}
+
+static void test_validators(void) {
+    const char *resp = "HTTP/1.1 200 OK\r\nETag:  \"cfg-v7\"\r\n"
+                       "Last-Modified: Tue, 13 Oct 2026 10:00:00 GMT\r\n"
+                       "Content-Length: 0\r\n\r\n";
+    const char *big = "HTTP/1.1 200 OK\r\nETag: \"0123456789012345678901234567890123456789"
+                      "0123456789\"\r\nContent-Length: 0\r\n\r\n";
+    http_validator_t v;
+    http_parser_t p;
+
+    reset(&p);
+    http_parser_validators(&p, &v);
+    feed(&p, resp, 3);
+    CHECK(!strcmp(v.etag, "\"cfg-v7\""));
+    CHECK(!strcmp(v.modified, "Tue, 13 Oct 2026 10:00:00 GMT"));
+
+    /* Value that doesn't fit is dropped, not truncated */
+    reset(&p);
+    http_parser_validators(&p, &v);
+    feed(&p, big, 100);
+    CHECK_EQ(p.state, HP_DONE);
+    CHECK_EQ(v.etag[0], 0);
+}
+
+static void test_request(void) {
+    char buf[256];
+    http_req_t r;
+    int n;
+
+    http_req_begin(&r, buf, sizeof(buf), "POST", "example.com", "/s");
+    http_req_header(&r, "Content-Type", "text/plain");
+    n = http_req_end(&r, "t=21.5", 6);
+    CHECK_EQ(n, (int)strlen("POST /s HTTP/1.1\r\nHost: example.com\r\n"
+                            "Content-Type: text/plain\r\nContent-Length: 6\r\n\r\nt=21.5"));
+    CHECK(!memcmp(buf, "POST /s HTTP/1.1\r\nHost: example.com\r\n"
+                       "Content-Type: text/plain\r\nContent-Length: 6\r\n\r\nt=21.5", n));
+
+    http_req_begin(&r, buf, 20, "POST", "example.com", "/s");
+    CHECK_EQ(http_req_end(&r, NULL, 0), -1);
+}
+
+static void test_pipe(void) {
+    char resp[] = "HTTP/1.1 200 OK\r\nETag: \"a\"\r\nContent-Length: 2\r\n\r\nok"
+                  "HTTP/1.1 201 Created\r\nETag: \"b\"\r\nContent-Length: 0\r\n\r\n"
+                  "HTTP/1.1 500 Error\r\nConnection: close\r\nContent-Length: 1\r\n\r\nE";
+    char last[] = "HTTP/1.0 200 OK\r\n\r\nbody";
+    http_pipe_t pp;
+    int i;
+
+    done_count = 0;
+    http_pipe_init(&pp, on_body, on_done, NULL);
+    http_parser_validators(&pp.parser, &pipe_valid);
+    for (i = 0; i < 4; i++)
+        http_pipe_sent(&pp, 0);
+    CHECK_EQ(http_pipe_feed(&pp, resp, 30), 4);
+    CHECK_EQ(http_pipe_feed(&pp, resp + 30, strlen(resp) - 30), 1);
+    CHECK_EQ(done_count, 3);
+    CHECK_EQ(done_status[1], 201);
+    CHECK_EQ(done_keepalive[1], 1);
+    CHECK_EQ(done_status[2], 500);
+    CHECK_EQ(done_keepalive[2], 0);
+    /* Validators of each response, not only first one */
+    CHECK(!strcmp(done_etag[0], "\"a\""));
+    CHECK(!strcmp(done_etag[1], "\"b\""));
+    CHECK_EQ(done_etag[2][0], 0);
+    CHECK_EQ(http_pipe_eof(&pp), 1);
+    CHECK_EQ(pp.pending, 0);
+
+    /* Request sent again on new connection, answered by body till close */
+    done_count = 0;
+    http_pipe_sent(&pp, 0);
+    CHECK_EQ(http_pipe_feed(&pp, last, strlen(last)), 1);
+    CHECK_EQ(http_pipe_eof(&pp), 0);
+    CHECK_EQ(done_count, 1);
+    CHECK_EQ(done_status[0], 200);
+}
+
+/* HEAD in the middle: its Content-Length doesn't mean body follows */
+static void test_pipe_head(void) {
+    char resp[] = "HTTP/1.1 200 OK\r\nContent-Length: 2\r\n\r\nok"
+                  "HTTP/1.1 200 OK\r\nContent-Length: 740\r\n\r\n"
+                  "HTTP/1.1 201 Created\r\nContent-Length: 0\r\n\r\n"
+                  "HTTP/1.1 200 OK\r\nContent-Length: 740\r\n\r\n";
+    http_pipe_t pp;
+    int i;
+
+    done_count = 0;
+    body_len = 0;
+    http_pipe_init(&pp, on_body, on_done, NULL);
+    http_pipe_sent(&pp, 0);
+    http_pipe_sent(&pp, HTTP_NOBODY);
+    http_pipe_sent(&pp, 0);
+    http_pipe_sent(&pp, HTTP_NOBODY);
+    for (i = 0; i < (int)strlen(resp); i += 11)
+        http_pipe_feed(&pp, resp + i, strlen(resp) - i < 11 ? strlen(resp) - i : 11);
+    CHECK_EQ(pp.pending, 0);
+    CHECK_EQ(done_count, 4);
+    CHECK_EQ(done_status[2], 201);
+    CHECK_EQ(body_len, 2);
+}
+
+/* Validators survive reboot, 304 is reported as not modified */
+static void test_cache(const char *flash) {
+    http_validator_t fresh = { "\"cfg-v7\"", "Tue, 13 Oct 2026 10:00:00 GMT" };
+    http_cache_t c;
+    http_validator_t *v;
+    http_req_t r;
+    char buf[256];
+
+    remove(flash);
+    CHECK_EQ(hal_flash_open(flash, 64 * SPI_FLASH_SEC_SIZE), 0);
+    CHECK_EQ(http_cache_load(&c, 8), -1);
+    v = http_cache_get(&c, "localhost", "/cfg.json");
+    CHECK_EQ(v->etag[0], 0);
+    CHECK_EQ(http_cache_update(&c, v, &fresh, 200), 0);
+    CHECK_EQ(http_cache_save(&c), 0);
+    http_cache_get(&c, "localhost", "/other.json");
+
+    CHECK_EQ(http_cache_load(&c, 8), 0);
+    v = http_cache_get(&c, "localhost", "/cfg.json");
+    CHECK(!strcmp(v->etag, fresh.etag));
+    http_req_begin(&r, buf, sizeof(buf), "GET", "localhost", "/cfg.json");
+    http_req_conditional(&r, v);
+    buf[http_req_end(&r, NULL, 0)] = 0;
+    CHECK(strstr(buf, "If-None-Match: \"cfg-v7\"\r\n") != NULL);
+    CHECK(strstr(buf, "If-Modified-Since: Tue, 13 Oct 2026 10:00:00 GMT\r\n") != NULL);
+    CHECK_EQ(http_cache_update(&c, v, &fresh, 304), 1);
+    remove(flash);
+}
+
+int main(int argc, char **argv) {
+    char flash[256];
+
+    snprintf(flash, sizeof(flash), "%s.flash", argv[0]);
+    test_length();
+    test_chunked();
+    test_nobody();
+    test_eof();
+    test_errors();
+    test_validators();
+    test_request();
+    test_pipe();
+    test_pipe_head();
+    test_cache(flash);
+    return test_done("http_test");
+}
@@ -0,0 +1,89 @@
+/*
+ * Copyright (C) 2017, Denys Fedoryshchenko
+ * Contact: <nuclearcat@nuclearcat.com>
+ * Licensed under the GPLv2
+ * <http://www.gnu.org/licenses/old-licenses/gpl-2.0.txt>
+ *
+ * ota.c: image coming as chunked HTTP response, parsed in odd sized pieces,
+ * goes through writer task and both buffers and ends in (file) flash as it
+ * was sent, CRC32 matches. Image that doesn't fit in flash sets error.
+ */
+#include "test.h"
+
+#define IMG_SIZE    10003
+#define IMG_ADDR    0x4000
+#define FLASH_SIZE  (64 * SPI_FLASH_SEC_SIZE)
+
+static char img[IMG_SIZE];
+static char resp[IMG_SIZE + 1024];
+
+/* Chunked response with image, chunks of different sizes */
+static int response(void) {
+    int len, i, n;
+
+    len = sprintf(resp, "HTTP/1.1 200 OK\r\nContent-Type: application/octet-stream\r\n"
+                  "Transfer-Encoding: chunked\r\n\r\n");
+    for (i = 0; i < IMG_SIZE; i += n) {
+        n = 500 + (i % 1500);
+        if (n > IMG_SIZE - i)
+            n = IMG_SIZE - i;
+        len += sprintf(resp + len, "%x\r\n", n);
+        memcpy(resp + len, img + i, n);
+        len += n;
+        len += sprintf(resp + len, "\r\n");
+    }
+    len += sprintf(resp + len, "0\r\n\r\n");
+    return len;
+}
+
+/* Response fed to parser in 97 byte pieces, returns ota_sink_finish() */
+static int download(ota_sink_t *s, uint32_t addr) {
+    http_parser_t p;
+    int len, i, n;
+
+    len = response();
+    CHECK_EQ(ota_sink_begin(s, addr), 0);
+    http_parser_init(&p, ota_sink_write, s);
+    for (i = 0; i < len; i += n) {
+        n = len - i < 97 ? len - i : 97;
+        http_parse(&p, resp + i, n);
+    }
+    CHECK_EQ(p.state, HP_DONE);
+    return ota_sink_finish(s);
+}
+
+int main(int argc, char **argv) {
+    static uint32_t back[(IMG_SIZE + 3) / 4];
+    char flash[256];
+    ota_sink_t s;
+    int i;
+
+    snprintf(flash, sizeof(flash), "%s.flash", argv[0]);
+    remove(flash);
+    CHECK_EQ(hal_flash_open(flash, FLASH_SIZE), 0);
+
+    CHECK_EQ(crc32_update(0, (const uint8_t *)"123456789", 9), 0xCBF43926);
+    CHECK_EQ(crc32_update(crc32_update(0, (const uint8_t *)"1234", 4),
+                          (const uint8_t *)"56789", 5), 0xCBF43926);
+
+    CHECK_EQ(ota_sink_begin(&s, IMG_ADDR + 1), -1);
+
+    for (i = 0; i < IMG_SIZE; i++)
+        img[i] = (i * 7 + 3) ^ (i >> 5);
+    CHECK_EQ(download(&s, IMG_ADDR), 0);
+    CHECK_EQ(s.error, 0);
+    CHECK_EQ(s.size, IMG_SIZE);
+    CHECK_EQ(s.crc, crc32_update(0, (const uint8_t *)img, IMG_SIZE));
+    CHECK(s.buf[0] == NULL && s.buf[1] == NULL);
+
+    CHECK_EQ(spi_flash_read(IMG_ADDR, back, sizeof(back)), SPI_FLASH_RESULT_OK);
+    CHECK(!memcmp(back, img, IMG_SIZE));
+
+    /* Third sector is past end of flash */
+    CHECK_EQ(download(&s, FLASH_SIZE - 2 * OTA_SECTOR), -1);
+    CHECK_EQ(s.error, 1);
+    CHECK(s.buf[0] == NULL && s.buf[1] == NULL);
+
+    remove(flash);
+    return test_done("ota_test");
+}
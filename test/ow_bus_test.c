@@ -0,0 +1,98 @@
+/*
+ * Copyright (C) 2017, Denys Fedoryshchenko
+ * Contact: <nuclearcat@nuclearcat.com>
+ * Licensed under the GPLv2
+ * <http://www.gnu.org/licenses/old-licenses/gpl-2.0.txt>
+ *
+ * ow.c with several devices on one bus: search, sweep with one conversion,
+ * alarm search. Built twice, bit-banging and with -DOW_UART.
+ */
+#include "test.h"
+
+void onewire_gpio_setup(void);
+
+#define DEVS    3
+
+static const int32_t temps[DEVS] = { 21500, -10250, 25300 };
+
+static int find(uint8_t (*roms)[8], int n, const uint8_t *rom) {
+    int i;
+
+    for (i = 0; i < n; i++) {
+        if (!memcmp(roms[i], rom, 8))
+            return i;
+    }
+    return -1;
+}
+
+int main(void) {
+    sim_dev_t *d[DEVS];
+    ds1820_dev_t devs[DEVS];
+    uint8_t roms[8][8];
+    int32_t diff;
+    int i, k, n;
+
+    d[0] = sim_ow_add(5, 0x28, 0x123456, temps[0]);
+    d[1] = sim_ow_add(5, 0x28, 0x654321, temps[1]);
+    d[2] = sim_ow_add(5, 0x10, 0xABCDEF, temps[2]);
+#ifdef OW_UART
+    hal_uart_attach(0, 5);
+    CHECK_EQ(onewire_uart_setup(), 0);
+#else
+    onewire_gpio_setup();
+#endif
+
+    n = onewire_search_all(roms, 8);
+    CHECK_EQ(n, DEVS);
+    for (i = 0; i < DEVS; i++)
+        CHECK(find(roms, n, sim_ow_rom(d[i])) >= 0);
+
+    /* Profiles are learned on first sweep, second one only converts and reads */
+    memset(devs, 0, sizeof(devs));
+    for (i = 0; i < DEVS; i++)
+        memcpy(devs[i].rom, sim_ow_rom(d[i]), 8);
+    for (k = 0; k < 2; k++) {
+        hal_stats_reset();
+        CHECK_EQ(ds1820_sweep(devs, DEVS), DEVS);
+        CHECK(test_ms() < 1000);
+        for (i = 0; i < DEVS; i++) {
+            CHECK_EQ(devs[i].status, 0);
+            CHECK(devs[i].valid);
+            /* DS1820 is 0.5C with extended resolution from COUNT_REMAIN */
+            diff = devs[i].temp - temps[i];
+            CHECK(diff > -100 && diff < 100);
+        }
+    }
+    CHECK(devs[2].cfg == 0x60);
+
+    /* Only devices out of TH/TL answer alarm search */
+    for (i = 0; i < DEVS; i++)
+        CHECK_EQ(ds1820_set_alarm(sim_ow_rom(d[i]), 22, -5, 0), 0);
+    hal_stats_reset();
+    n = ds1820_alarm_scan(devs, DEVS, roms, 8);
+    CHECK(test_ms() > 750);
+    CHECK_EQ(n, 2);
+    CHECK(find(roms, n, sim_ow_rom(d[1])) >= 0);
+    CHECK(find(roms, n, sim_ow_rom(d[2])) >= 0);
+    sim_ow_set_temp(d[2], 20000);
+    CHECK_EQ(ds1820_alarm_scan(devs, DEVS, roms, 8), 1);
+
+    /* DS18B20s at 9 bit, wait is by their profiles */
+    for (i = 0; i < 2; i++) {
+        uint8_t cfg[3] = { 22, -5, 0x1F };
+        onewire_xfer_t x = { .rom = devs[i].rom, .cmd = 0x4E, .wr = cfg, .wlen = 3 };
+
+        CHECK_EQ(onewire_transaction(&x), 0);
+        devs[i].valid = 0;
+    }
+    hal_stats_reset();
+    CHECK_EQ(ds1820_alarm_scan(devs, 2, roms, 8), 1);
+    CHECK(test_ms() < 200);
+    CHECK(!memcmp(roms[0], devs[1].rom, 8));
+
+#ifdef OW_UART
+    return test_done("ow_bus_uart_test");
+#else
+    return test_done("ow_bus_test");
+#endif
+}
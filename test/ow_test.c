@@ -0,0 +1,170 @@
+/*
+ * Copyright (C) 2017, Denys Fedoryshchenko
+ * Contact: <nuclearcat@nuclearcat.com>
+ * Licensed under the GPLv2
+ * <http://www.gnu.org/licenses/old-licenses/gpl-2.0.txt>
+ *
+ * ow.c with one device on bus: single reads, transaction API, overdrive,
+ * power gating and parasite power, and parallel read of separate buses.
+ * Built bit-banging with each OW_LOCK_GRANULARITY and with -DOW_UART.
+ */
+#include "test.h"
+
+/* OW_LOCK_GRANULARITY values of ow.c */
+#define LOCK_BIT            0
+#define LOCK_BYTE           1
+#define LOCK_TRANSACTION    2
+
+#ifndef OW_LOCK_GRANULARITY
+#define OW_LOCK_GRANULARITY LOCK_BIT
+#endif
+
+#if defined(OW_UART)
+#define TEST_NAME   "ow_uart_test"
+#elif OW_LOCK_GRANULARITY == LOCK_BYTE
+#define TEST_NAME   "ow_byte_test"
+#elif OW_LOCK_GRANULARITY == LOCK_TRANSACTION
+#define TEST_NAME   "ow_xact_test"
+#else
+#define TEST_NAME   "ow_test"
+#endif
+
+void onewire_gpio_setup(void);
+int onewire_reset(void);
+void onewire_write(int data);
+int onewire_read(void);
+
+static void test_read(sim_dev_t *d) {
+    int32_t mc;
+    double t;
+
+    CHECK_EQ(ds1820_read_mc(&mc), 0);
+    CHECK_EQ(mc, 21500);
+    sim_ow_set_temp(d, -10250);
+    CHECK_EQ(ds1820_read(&t), 0);
+    CHECK(t == -10.25);
+    sim_ow_set_temp(d, 21500);
+}
+
+/* Longest time with interrupts masked, UART backend never masks them */
+static void test_lock(void) {
+    hal_stats_t st;
+    int32_t mc;
+
+    hal_stats_reset();
+    CHECK_EQ(ds1820_read_mc(&mc), 0);
+    hal_stats_get(&st);
+#if defined(OW_UART)
+    CHECK_EQ(st.locks, 0);
+#elif OW_LOCK_GRANULARITY == LOCK_BIT
+    CHECK(st.masked_max < HAL_US(80));
+#elif OW_LOCK_GRANULARITY == LOCK_BYTE
+    CHECK(st.masked_max > HAL_US(500));
+    CHECK(st.masked_max < HAL_US(1000));
+#else
+    /* Whole scratchpad read */
+    CHECK(st.masked_max > HAL_US(9 * 500));
+#endif
+}
+
+/* Same scratchpad bytewise and as one transaction */
+static void test_xfer(sim_dev_t *d) {
+    const uint8_t *rom = sim_ow_rom(d);
+    uint8_t a[9], b[9];
+    onewire_xfer_t x = { .rom = rom, .cmd = 0xBE, .rd = b, .rlen = 9, .flags = OW_XFER_CRC8 };
+    int i;
+
+    onewire_lock();
+    CHECK_EQ(onewire_reset(), 0);
+    onewire_select(rom);
+    onewire_write(0xBE);
+    for (i = 0; i < 9; i++)
+        a[i] = onewire_read();
+    onewire_unlock();
+    CHECK_EQ(crc8_data(a, 8), a[8]);
+
+    CHECK_EQ(onewire_transaction(&x), 0);
+    CHECK(!memcmp(a, b, 9));
+}
+
+static void test_overdrive(sim_dev_t *d) {
+    ds1820_conv_t c = { .rom = NULL, .family = 0x28, .cfg = 0x60, .powered = 1 };
+    int32_t mc;
+
+    sim_ow_set_overdrive(d, 1);
+    CHECK_EQ(onewire_overdrive_skip(), 0);
+    CHECK_EQ(ds1820_start(&c), 0);
+    ds1820_wait(&c);
+    CHECK_EQ(ds1820_complete(&c, &mc), 0);
+    CHECK_EQ(mc, 21500);
+    onewire_set_speed(OW_SPEED_STANDARD);
+    CHECK_EQ(onewire_reset(), 0);
+    CHECK_EQ(ds1820_read_mc(&mc), 0);
+}
+
+static void test_power(sim_dev_t *d) {
+#ifndef OW_UART
+    uint8_t roms[2][8];
+#endif
+    int32_t mc;
+
+    CHECK_EQ(onewire_power_up(), 1);
+    CHECK_EQ(ds1820_read_mc(&mc), 0);
+    onewire_deep_sleep(60000000ULL);
+    CHECK_EQ(hal_pin_get(4), 0);
+
+    /* Conversion on strong pullup, alarm copied to EEPROM */
+    sim_ow_set_parasite(d, 1);
+    CHECK_EQ(onewire_power_up(), 0);
+    CHECK_EQ(ds1820_read_mc(&mc), 0);
+#ifdef OW_UART
+    /* UART can't drive bus high, conversion fails as on real bus */
+    CHECK_EQ(mc, 85000);
+#else
+    CHECK_EQ(mc, 21500);
+    CHECK_EQ(ds1820_set_alarm(sim_ow_rom(d), 20, -10, 1), 0);
+    CHECK_EQ(ds1820_alarm_scan(NULL, 0, roms, 2), 1);
+    CHECK_EQ(ds1820_set_alarm(sim_ow_rom(d), 25, -10, 0), 0);
+    CHECK_EQ(ds1820_alarm_scan(NULL, 0, roms, 2), 0);
+#endif
+    sim_ow_set_parasite(d, 0);
+    CHECK_EQ(onewire_power_up(), 1);
+}
+
+/* One device per pin, GPIO16 is not in GPIO.in and is ignored */
+static void test_multi(void) {
+    int32_t temp[OW_MULTI_PINS];
+    int status[OW_MULTI_PINS];
+    uint32_t mask = (1 << 12) | (1 << 13) | (1 << 14) | (1 << 15);
+
+    sim_ow_add(12, 0x28, 1, 20000);
+    sim_ow_add(13, 0x10, 2, -10250);
+    sim_ow_add(14, 0x28, 3, 30000);
+    onewire_multi_setup(mask);
+    hal_stats_reset();
+    CHECK_EQ(ds1820_multi_read(mask | (1 << 16), temp, status), (1 << 12) | (1 << 13) | (1 << 14));
+    CHECK(test_ms() < 1000);
+    CHECK_EQ(status[12], 0);
+    CHECK_EQ(temp[12], 20000);
+    CHECK_EQ(temp[13], -10250);
+    CHECK_EQ(temp[14], 30000);
+    CHECK_EQ(status[15], -1);
+}
+
+int main(void) {
+    sim_dev_t *d = sim_ow_add(5, 0x28, 0x123456, 21500);
+
+#ifdef OW_UART
+    hal_uart_attach(0, 5);
+    CHECK_EQ(onewire_uart_setup(), 0);
+#else
+    onewire_gpio_setup();
+#endif
+    test_read(d);
+    test_lock();
+    test_xfer(d);
+    test_overdrive(d);
+    test_power(d);
+    test_multi();
+    return test_done(TEST_NAME);
+}
@@ -0,0 +1,102 @@
+/*
+ * Copyright (C) 2017, Denys Fedoryshchenko
+ * Contact: <nuclearcat@nuclearcat.com>
+ * Licensed under the GPLv2
+ * <http://www.gnu.org/licenses/old-licenses/gpl-2.0.txt>
+ *
+ * rlog.c over file backed flash and RTC memory: wakes from deep sleep, upload
+ * and ack, cold boot, ring wrap-around and a damaged record.
+ */
+#include "test.h"
+
+#define LOG_SEC     16
+#define REC_SIZE    32
+#define PER_SEC     ( SPI_FLASH_SEC_SIZE / REC_SIZE )
+#define ID          0x9A06050403020128ULL
+
+static char flash[256], rtc[256];
+static uint32_t next_time;
+
+/* One wake: init from RTC memory, one reading */
+static void wake(uint32_t time) {
+    tlm_reading_t r = { .id = ID, .time = time, .temp = time * 10 };
+
+    rlog_init(LOG_SEC);
+    CHECK_EQ(rlog_append(&r), 0);
+}
+
+/* Read up to max readings from tail, check order and content, ack them */
+static int upload(int max) {
+    tlm_reading_t r[16];
+    uint32_t pos = rlog_tail();
+    int n, i, total = 0;
+
+    while (total < max && (n = rlog_read(&pos, r, max - total < 16 ? max - total : 16)) > 0) {
+        for (i = 0; i < n; i++) {
+            CHECK(r[i].time >= next_time);
+            CHECK_EQ(r[i].id, ID);
+            CHECK_EQ(r[i].temp, (int32_t)r[i].time * 10);
+            next_time = r[i].time + 1;
+        }
+        total += n;
+    }
+    CHECK_EQ(rlog_ack(pos), 0);
+    return total;
+}
+
+/* New RTC file is random, as after power loss */
+static void cold_boot(void) {
+    remove(rtc);
+    CHECK_EQ(hal_rtc_open(rtc), 0);
+}
+
+int main(int argc, char **argv) {
+    uint32_t zero = 0, t;
+    int n;
+
+    snprintf(flash, sizeof(flash), "%s.flash", argv[0]);
+    snprintf(rtc, sizeof(rtc), "%s.rtc", argv[0]);
+    remove(flash);
+    CHECK_EQ(hal_flash_open(flash, 64 * SPI_FLASH_SEC_SIZE), 0);
+    cold_boot();
+    CHECK_EQ(rlog_init(LOG_SEC), 0);
+
+    for (t = 0; t < 100; t++)
+        wake(t);
+    CHECK_EQ(rlog_pending(), 100);
+    CHECK_EQ(upload(40), 40);
+    CHECK_EQ(rlog_pending(), 60);
+    CHECK_EQ(next_time, 40);
+
+    /* Only readings still in RTC memory (not flushed yet) are lost */
+    cold_boot();
+    CHECK_EQ(rlog_init(LOG_SEC), 96 - 40);
+    CHECK_EQ(upload(1000), 96 - 40);
+    CHECK_EQ(next_time, 96);
+
+    /* Ring keeps last sectors, oldest readings are dropped */
+    for (t = 1000; t < 3000; t++)
+        wake(t);
+    n = rlog_pending();
+    CHECK(n < 8 * PER_SEC + 12);
+    CHECK(n > 6 * PER_SEC);
+    CHECK_EQ(upload(10000), n);
+    CHECK_EQ(next_time, 3000);
+    CHECK_EQ(rlog_pending(), 0);
+
+    /* Damaged record in flash is skipped, rest is read */
+    for (t = 3000; t < 3100; t++)
+        wake(t);
+    CHECK_EQ(rlog_flush(), 0);
+    t = rlog_tail() + 10;
+    CHECK_EQ(spi_flash_write((LOG_SEC + (t / PER_SEC) % 8) * SPI_FLASH_SEC_SIZE +
+                             (t % PER_SEC) * REC_SIZE + 4, &zero, 4), SPI_FLASH_RESULT_OK);
+    cold_boot();
+    CHECK_EQ(rlog_init(LOG_SEC), 100);
+    CHECK_EQ(upload(1000), 99);
+    CHECK_EQ(next_time, 3100);
+
+    remove(flash);
+    remove(rtc);
+    return test_done("rlog_test");
+}
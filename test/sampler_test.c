@@ -0,0 +1,56 @@
+/*
+ * Copyright (C) 2017, Denys Fedoryshchenko
+ * Contact: <nuclearcat@nuclearcat.com>
+ * Licensed under the GPLv2
+ * <http://www.gnu.org/licenses/old-licenses/gpl-2.0.txt>
+ *
+ * sampler.c driven by hand: DHT pins are read while DS1820 converts, each
+ * sensor only when due, last good value is kept.
+ */
+#include "test.h"
+
+int main(void) {
+    sim_dev_t *a = sim_ow_add(5, 0x28, 1, 20000);
+    sim_dev_t *b = sim_ow_add(5, 0x10, 2, 25000);
+    sampler_value_t v;
+    uint32_t wait, t0;
+    int ds_a, ds_b, dht_a, dht_b;
+
+    /* Parasite one needs strong pullup for whole conversion */
+    sim_ow_set_parasite(a, 1);
+    ds_a = sampler_add_ds1820(sim_ow_rom(a), 1000);
+    ds_b = sampler_add_ds1820(sim_ow_rom(b), 5000);
+    sim_dht_add(12, 22, 215, 456);
+    sim_dht_add(13, 22, -30, 800);
+    dht_a = sampler_add_dht(12, 500);
+    dht_b = sampler_add_dht(13, 3000);
+    CHECK_EQ(sampler_add_dht(16, 3000), -1);
+    CHECK_EQ(sampler_get(ds_a, &v), -1);
+
+    /* All due, DHT read inside DS1820 conversion time */
+    hal_stats_reset();
+    wait = sampler_step();
+    CHECK(test_ms() < 850);
+    CHECK_EQ(sampler_get(ds_a, &v), 0);
+    CHECK_EQ(v.temp, 20000);
+    CHECK_EQ(sampler_get(ds_b, &v), 0);
+    CHECK_EQ(v.temp, 25000);
+    CHECK_EQ(sampler_get(dht_a, &v), 0);
+    CHECK_EQ(v.temp, 21500);
+    CHECK_EQ(v.hum, 45600);
+    CHECK_EQ(sampler_get(dht_b, &v), 0);
+    CHECK_EQ(v.temp, -3000);
+    t0 = v.time;
+
+    /* Next step only for sensors with short interval */
+    sim_ow_set_temp(a, 21000);
+    vTaskDelay(wait);
+    sampler_step();
+    CHECK_EQ(sampler_get(ds_a, &v), 0);
+    CHECK_EQ(v.temp, 21000);
+    CHECK_EQ(sampler_get(dht_b, &v), 0);
+    CHECK_EQ(v.time, t0);
+    CHECK_EQ(sampler_get(99, &v), -1);
+
+    return test_done("sampler_test");
+}
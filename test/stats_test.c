@@ -0,0 +1,53 @@
+/*
+ * Copyright (C) 2017, Denys Fedoryshchenko
+ * Contact: <nuclearcat@nuclearcat.com>
+ * Licensed under the GPLv2
+ * <http://www.gnu.org/licenses/old-licenses/gpl-2.0.txt>
+ *
+ * stats.c with -DDRV_STATS: masked windows counted by drivers match what
+ * virtual clock saw, reset and slots land in their histograms.
+ */
+#include "test.h"
+#include "stats.h"
+
+void onewire_gpio_setup(void);
+
+int main(void) {
+    hal_stats_t hs;
+    stats_t s;
+    int32_t mt, mh;
+
+    sim_ow_add(5, 0x28, 0x123456, 21500);
+    sim_dht_add(4, 22, 215, 456);
+    onewire_gpio_setup();
+    dht_init();
+
+    stats_reset();
+    hal_stats_reset();
+    CHECK_EQ(ds1820_read_mc(&mt), 0);
+    hal_stats_get(&hs);
+    stats_get(STATS_OW_MASKED, &s);
+    CHECK_EQ(s.count, hs.locks);
+    /* Driver sees the window from inside, a few cycles shorter */
+    CHECK(s.max <= hs.masked_max && s.max + 80 > hs.masked_max);
+    CHECK(s.total <= hs.masked && s.total + s.count * 80 > hs.masked);
+    CHECK(s.min > 0 && s.min <= s.max);
+    stats_get(STATS_OW_RESET, &s);
+    CHECK(s.count >= 2);
+    /* Reset is 480us low and 480us presence */
+    CHECK(s.min >= 960 * 80);
+    CHECK_EQ(s.hist[5] + s.hist[6], s.count);
+    stats_get(STATS_OW_SLOT, &s);
+    CHECK(s.count >= 9 * 8);
+
+    stats_reset();
+    CHECK_EQ(dht_read_mc(&mt, &mh), 0);
+    stats_get(STATS_DHT_MASKED, &s);
+    CHECK_EQ(s.count, 1);
+    /* Whole frame, 4-5ms */
+    CHECK(s.max > 3000 * 80 && s.max < 6000 * 80);
+    stats_get(STATS_OW_MASKED, &s);
+    CHECK_EQ(s.count, 0);
+
+    return test_done("stats_test");
+}
@@ -0,0 +1,125 @@
+/*
+ * Copyright (C) 2017, Denys Fedoryshchenko
+ * Contact: <nuclearcat@nuclearcat.com>
+ * Licensed under the GPLv2
+ * <http://www.gnu.org/licenses/old-licenses/gpl-2.0.txt>
+ *
+ * DS1820/DS18B20 scratchpad to temperature: double code ow.c had before
+ * against integer milli C it has now (copy of ds1820_temp()), same results
+ * for every raw value (old one was 1/16C off below zero), and conversions per
+ * second of both. Virtual clock counts only bus time, which is same for both,
+ * so this uses host clock as crc8_bench. Host has FPU, on ESP8266 each double
+ * op is soft float call, so there difference is much bigger.
+ */
+#include "test.h"
+#include <time.h>
+
+#define ROUNDS  40
+
+/* Keeps results alive, so loops are not optimized out */
+static volatile int32_t sink;
+
+/* As it was, result in C */
+static double temp_double(uint8_t type, const uint8_t *data) {
+    double temp, minus, count_per_c, count_remain;
+    uint8_t cfg, mask;
+    uint16_t raw;
+
+    if (type == 0x10) {
+        temp = (double)(data[0] >> 1);
+        count_per_c = 0x10;
+        count_remain = data[6];
+        return temp - 0.25 + ((count_per_c - count_remain) / count_per_c);
+    }
+    minus = 1.0;
+    if (data[1] & 0x80)
+        minus = -1.0;
+    cfg = data[4] & 0x60;
+    mask = 0xFF;
+    if (cfg == 0x00)
+        mask = 0xF8;
+    else if (cfg == 0x20)
+        mask = 0xFC;
+    else if (cfg == 0x40)
+        mask = 0xFE;
+    raw = (data[1] << 8) | (data[0] & mask);
+    if (minus == -1.0)
+        raw = 0xFFFF - raw;
+    return (double)raw * 0.0625 * minus;
+}
+
+/* ds1820_temp() of ow.c, milli C */
+static int32_t temp_mc(uint8_t type, const uint8_t *data) {
+    int32_t raw = (int16_t)((data[1] << 8) | data[0]);
+
+    if (type == 0x10) {
+        raw = ((raw >> 1) << 4) + 12 - data[6];
+    } else {
+        raw &= ~((1 << (3 - ((data[4] >> 5) & 3))) - 1);
+    }
+    return (raw * 125) >> 1;
+}
+
+static double now_s(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Scratchpad of DS18B20 with raw value and resolution */
+static void scratchpad(uint8_t *data, uint16_t raw, int cfg) {
+    memset(data, 0, 9);
+    data[0] = raw;
+    data[1] = raw >> 8;
+    data[4] = (cfg << 5) | 0x1F;
+    data[6] = 0x10 - (raw & 0x0F);
+}
+
+int main(void) {
+    uint8_t data[9];
+    double t, fp, fx, mc;
+    int32_t acc = 0;
+    int raw, cfg, k;
+
+    /* DS18B20, every raw value at 12 bits, 9 bits drops low 3. Half mC
+     * rounds down in integer, to zero in double */
+    for (cfg = 0; cfg < 4; cfg += 3) {
+        for (raw = 0; raw < 0x10000; raw++) {
+            scratchpad(data, raw, cfg);
+            mc = temp_double(0x28, data) * 1000;
+            if (raw & 0x8000)
+                mc -= 62.5;
+                    CHECK(abs(temp_mc(0x28, data) * 2 - (int32_t)(mc * 2)) <= 1);
+        }
+    }
+    /* DS1820 above zero, 0.5C steps refined by COUNT_REMAIN */
+    for (raw = 0; raw < 0x100; raw++) {
+        for (k = 1; k <= 16; k++) {
+            scratchpad(data, raw, 3);
+            data[6] = k;
+            mc = temp_double(0x10, data) * 1000;
+            CHECK(abs(temp_mc(0x10, data) * 2 - (int32_t)(mc * 2)) <= 1);
+        }
+    }
+
+    t = now_s();
+    for (k = 0; k < ROUNDS; k++) {
+        for (raw = 0; raw < 0x10000; raw++) {
+            scratchpad(data, raw, 3);
+            acc += (int32_t)(temp_double(raw & 1 ? 0x10 : 0x28, data) * 1000);
+        }
+    }
+    fp = ROUNDS * 65536.0 / (now_s() - t);
+    t = now_s();
+    for (k = 0; k < ROUNDS; k++) {
+        for (raw = 0; raw < 0x10000; raw++) {
+            scratchpad(data, raw, 3);
+            acc += temp_mc(raw & 1 ? 0x10 : 0x28, data);
+        }
+    }
+    fx = ROUNDS * 65536.0 / (now_s() - t);
+    sink = acc;
+    printf("ds1820 temp: double %.1f M/s, integer %.1f M/s, x%.1f\n", fp / 1e6, fx / 1e6, fx / fp);
+    return test_failed;
+}
@@ -0,0 +1,41 @@
+/*
+ * Copyright (C) 2017, Denys Fedoryshchenko
+ * Contact: <nuclearcat@nuclearcat.com>
+ * Licensed under the GPLv2
+ * <http://www.gnu.org/licenses/old-licenses/gpl-2.0.txt>
+ *
+ * Minimal checks for host tests (make test), each test is own program with
+ * own simulated bus, exit status is number of failed checks.
+ */
+#include "hal.h"
+#include "esp8266stuff.h"
+
+static int test_failed;
+
+#define CHECK(cond) do { \
+    if (!(cond)) { \
+        printf("%s:%d: FAIL %s\n", __FILE__, __LINE__, #cond); \
+        test_failed++; \
+    } \
+} while (0)
+
+#define CHECK_EQ(a, b) do { \
+    long long _a = (a), _b = (b); \
+    if (_a != _b) { \
+        printf("%s:%d: FAIL %s == %s (%lld != %lld)\n", __FILE__, __LINE__, #a, #b, _a, _b); \
+        test_failed++; \
+    } \
+} while (0)
+
+static inline int test_done(const char *name) {
+    printf("%s: %s\n", name, test_failed ? "FAILED" : "ok");
+    return test_failed;
+}
+
+/* Virtual time of last hal_stats_reset() .. now, in ms */
+static inline double test_ms(void) {
+    hal_stats_t st;
+
+    hal_stats_get(&st);
+    return st.cycles / 80000.0;
+}
@@ -0,0 +1,99 @@
+/*
+ * Copyright (C) 2017, Denys Fedoryshchenko
+ * Contact: <nuclearcat@nuclearcat.com>
+ * Licensed under the GPLv2
+ * <http://www.gnu.org/licenses/old-licenses/gpl-2.0.txt>
+ *
+ * Size of telemetry.c batch against JSON for typical node (figures in
+ * README.md): 3 DS1820 and one DHT22 read each 10s, 64 readings. Also encode
+ * and decode time per reading on host.
+ */
+#include "test.h"
+#include <time.h>
+
+#define N       64
+#define ROUNDS  20000
+
+static tlm_reading_t in[N];
+
+static void readings(void) {
+    static const uint8_t roms[3][8] = {
+        { 0x28, 1, 2, 3, 4, 5, 6, 0x9A },
+        { 0x28, 7, 7, 7, 7, 7, 7, 0x11 },
+        { 0x10, 9, 8, 7, 6, 5, 4, 0xC3 },
+    };
+    int i, round, s;
+
+    for (i = 0; i < N; i++) {
+        round = i / 4;
+        s = i % 4;
+        in[i].time = 1760000000u + round * 10000 + s * 3 + (round % 5 == 3 ? 20 : 0);
+        if (s < 3) {
+            in[i].id = tlm_rom_id(roms[s]);
+            in[i].temp = 21500 + s * 1000 + (round % 3) * 62 - (s == 2) * 40000;
+        } else {
+            in[i].id = TLM_DHT_ID(4);
+            in[i].temp = 23400 + round * 100;
+            in[i].hum = 45600 - round * 300;
+        }
+    }
+}
+
+/* Same readings as JSON array, as node would send without encoder */
+static int json_len(void) {
+    char tmp[256];
+    int i, len = 2;
+
+    for (i = 0; i < N; i++) {
+        if (TLM_HAS_HUM(in[i].id))
+            len += sprintf(tmp, "{\"id\":\"dht%d\",\"t\":%u,\"temp\":%.3f,\"hum\":%.3f},",
+                           (int)in[i].id, in[i].time, in[i].temp / 1000.0, in[i].hum / 1000.0);
+        else
+            len += sprintf(tmp, "{\"id\":\"%016llx\",\"t\":%u,\"temp\":%.3f},",
+                           (unsigned long long)in[i].id, in[i].time, in[i].temp / 1000.0);
+    }
+    return len;
+}
+
+static double now_s(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int encode(uint8_t *buf, int size, int format) {
+    tlm_enc_t e;
+    int i;
+
+    tlm_begin(&e, buf, size, format);
+    for (i = 0; i < N; i++)
+        CHECK_EQ(tlm_add(&e, &in[i]), 0);
+    return tlm_end(&e);
+}
+
+int main(void) {
+    static const char *names[] = { "raw", "cbor" };
+    uint8_t buf[1024];
+    double t, enc, dec;
+    int format, len, k;
+
+    readings();
+    for (format = TLM_RAW; format <= TLM_CBOR; format++) {
+        len = encode(buf, sizeof(buf), format);
+        CHECK_EQ(tlm_decode(buf, len, NULL, NULL), N);
+
+        t = now_s();
+        for (k = 0; k < ROUNDS; k++)
+            encode(buf, sizeof(buf), format);
+        enc = (now_s() - t) * 1e9 / ((double)ROUNDS * N);
+        t = now_s();
+        for (k = 0; k < ROUNDS; k++)
+            tlm_decode(buf, len, NULL, NULL);
+        dec = (now_s() - t) * 1e9 / ((double)ROUNDS * N);
+        printf("tlm %-4s: %d readings %d bytes (%.1f/reading), encode %.0f ns, decode %.0f ns per reading\n",
+               names[format], N, len, (double)len / N, enc, dec);
+    }
+    printf("tlm json: %d readings %d bytes\n", N, json_len());
+    return test_failed;
+}
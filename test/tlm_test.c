@@ -0,0 +1,126 @@
+/*
+ * Copyright (C) 2017, Denys Fedoryshchenko
+ * Contact: <nuclearcat@nuclearcat.com>
+ * Licensed under the GPLv2
+ * <http://www.gnu.org/licenses/old-licenses/gpl-2.0.txt>
+ *
+ * telemetry.c: readings come back from tlm_decode() exactly as added, in both
+ * formats, also when buffer or sensor table gets full. Bad batches are
+ * rejected.
+ */
+#include "test.h"
+
+#define N   64
+
+static tlm_reading_t in[N];
+static int nout, bad;
+
+static void check_cb(void *ctx, const tlm_reading_t *r) {
+    if (nout >= N || memcmp(r, &in[nout], sizeof(*r)))
+        bad++;
+    nout++;
+}
+
+/* Decoded readings, -1 if batch is rejected */
+static int decode(const uint8_t *buf, int len) {
+    nout = bad = 0;
+    return tlm_decode(buf, len, check_cb, NULL);
+}
+
+/* 3 DS1820 and DHT22 on pin 4, 10s interval with jitter, time wraps */
+static void readings(void) {
+    static const uint8_t roms[3][8] = {
+        { 0x28, 1, 2, 3, 4, 5, 6, 0x9A },
+        { 0x28, 7, 7, 7, 7, 7, 7, 0x11 },
+        { 0x10, 9, 8, 7, 6, 5, 4, 0xC3 },
+    };
+    int i, round, s;
+
+    memset(in, 0, sizeof(in));
+    for (i = 0; i < N; i++) {
+        round = i / 4;
+        s = i % 4;
+        in[i].time = 0xFFFF0000u + round * 10000 + s * 3 + (round % 5 == 3 ? 20 : 0);
+        if (s < 3) {
+            in[i].id = tlm_rom_id(roms[s]);
+            in[i].temp = 21500 + s * 1000 + (round % 3) * 62 - (s == 2) * 40000;
+        } else {
+            in[i].id = TLM_DHT_ID(4);
+            in[i].temp = 23400 + round * 100;
+            in[i].hum = 45600 - round * 300;
+        }
+    }
+}
+
+static void test_roundtrip(int format) {
+    uint8_t buf[1024];
+    tlm_enc_t e;
+    int i, len;
+
+    CHECK_EQ(tlm_begin(&e, buf, sizeof(buf), format), 0);
+    for (i = 0; i < N; i++)
+        CHECK_EQ(tlm_add(&e, &in[i]), 0);
+    len = tlm_end(&e);
+    CHECK_EQ(e.count, N);
+    CHECK_EQ(decode(buf, len), N);
+    CHECK_EQ(bad, 0);
+    /* Truncated batch is not accepted */
+    if (format == TLM_CBOR)
+        CHECK_EQ(decode(buf, len - 1), -1);
+    CHECK_EQ(decode(buf, len - 3), -1);
+}
+
+/* Reading that doesn't fit leaves batch as it was, still decodable */
+static void test_full(int format) {
+    uint8_t buf[40];
+    tlm_enc_t e;
+    int i, len;
+
+    tlm_begin(&e, buf, sizeof(buf), format);
+    for (i = 0; i < N && !tlm_add(&e, &in[i]); i++)
+        ;
+    CHECK(i > 0 && i < N);
+    len = tlm_end(&e);
+    CHECK(len <= (int)sizeof(buf));
+    CHECK_EQ(decode(buf, len), i);
+    CHECK_EQ(bad, 0);
+}
+
+static void test_sensors(void) {
+    tlm_reading_t r = { .time = 1000, .temp = 20000 };
+    uint8_t buf[1024];
+    tlm_enc_t e;
+    int i;
+
+    tlm_begin(&e, buf, sizeof(buf), TLM_RAW);
+    for (i = 0; i < TLM_SENSORS; i++) {
+        r.id = 0x1000 + i;
+        CHECK_EQ(tlm_add(&e, &r), 0);
+    }
+    r.id = 0x2000;
+    CHECK_EQ(tlm_add(&e, &r), -1);
+    r.id = 0x1000;
+    CHECK_EQ(tlm_add(&e, &r), 0);
+    CHECK_EQ(tlm_decode(buf, tlm_end(&e), NULL, NULL), TLM_SENSORS + 1);
+}
+
+static void test_bad(void) {
+    uint8_t junk[4] = { 0x42, 0, 0, 0 };
+    uint8_t slot[3] = { 0x01, 0x05, 0x00 };
+
+    CHECK_EQ(tlm_decode(junk, sizeof(junk), NULL, NULL), -1);
+    CHECK_EQ(tlm_decode(junk, 0, NULL, NULL), -1);
+    /* Slot that was never declared */
+    CHECK_EQ(tlm_decode(slot, sizeof(slot), NULL, NULL), -1);
+}
+
+int main(void) {
+    readings();
+    test_roundtrip(TLM_RAW);
+    test_roundtrip(TLM_CBOR);
+    test_full(TLM_RAW);
+    test_full(TLM_CBOR);
+    test_sensors();
+    test_bad();
+    return test_done("tlm_test");
+}